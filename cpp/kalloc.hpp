@@ -0,0 +1,98 @@
+#ifndef KALLOC_HPP
+#define KALLOC_HPP
+
+#include <cstddef> // for size_t
+#include <new>     // for placement new
+#include "../kalloc.h"
+
+/* // ==> Code example <==
+#include <vector>
+#include "kalloc.hpp"
+#include "khashl.hpp"
+
+int main(void)
+{
+	klib::KArena arena;
+	{
+		klib::KArena::Scope scope(arena); // everything below is freed when the scope ends
+		std::vector<int, klib::KAllocator<int> > v(arena.allocator<int>());
+		klib::KHashMap<uint32_t, int, std::hash<uint32_t>, std::equal_to<uint32_t>, uint32_t, klib::KAllocator<int> > h(arena.allocator<int>());
+		v.push_back(1), h[1] = 2;
+	}
+	return 0;
+}
+*/
+
+namespace klib {
+
+/**************
+ * KAllocator *
+ **************/
+
+// A std::allocator-compatible adapter over kmalloc()/kfree(). A null _km_
+// falls back to malloc()/free(). The allocator does not own _km_.
+template<class T>
+class KAllocator {
+	template<class U> friend class KAllocator;
+	void *km;
+public:
+	typedef T value_type;
+	typedef T *pointer;
+	typedef const T *const_pointer;
+	typedef T &reference;
+	typedef const T &const_reference;
+	typedef std::size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+	template<class U> struct rebind { typedef KAllocator<U> other; };
+
+	KAllocator(void *km_ = 0) : km(km_) {};
+	template<class U> KAllocator(const KAllocator<U> &a) : km(a.km) {};
+	inline void *get_km() const { return km; }
+	inline T *allocate(size_type n, const void* = 0) { return (T*)kmalloc(km, n * sizeof(T)); }
+	inline void deallocate(T *p, size_type) { kfree(km, p); }
+	inline size_type max_size() const { return size_type(-1) / sizeof(T); }
+	inline void construct(T *p, const T &x) { new((void*)p) T(x); }
+	inline void destroy(T *p) { p->~T(); }
+	inline T *address(T &x) const { return &x; }
+	inline const T *address(const T &x) const { return &x; }
+	template<class U> bool operator==(const KAllocator<U> &a) const { return km == a.km; }
+	template<class U> bool operator!=(const KAllocator<U> &a) const { return km != a.km; }
+};
+
+/**********
+ * KArena *
+ **********/
+
+// A bump-pointer arena, destroyed with all its allocations when the object
+// goes out of scope. KArena::Scope frees the allocations made during its
+// lifetime, such that an arena can be reused across iterations of a loop.
+// Destructors of objects in the arena are not called by reset() or Scope.
+class KArena {
+	void *km;
+	KArena(const KArena&);
+	KArena &operator=(const KArena&);
+public:
+	KArena(void *km_par = 0, size_t chunk_size = 0) : km(km_init_arena(km_par, chunk_size)) {};
+	~KArena() { km_destroy(km); };
+	inline void *get_km() const { return km; }
+	inline void *alloc(size_t size) { return kmalloc(km, size); }
+	template<class T> inline KAllocator<T> allocator() const { return KAllocator<T>(km); }
+	inline km_mark_t mark() const { return km_mark(km); }
+	inline void release(km_mark_t m) { km_release_to_mark(km, m); }
+	inline void reset() { km_reset(km); }
+	inline void trim() { km_trim(km); }
+
+	class Scope {
+		KArena &a;
+		km_mark_t m;
+		Scope(const Scope&);
+		Scope &operator=(const Scope&);
+	public:
+		Scope(KArena &a_) : a(a_), m(a_.mark()) {};
+		~Scope() { a.release(m); };
+	};
+};
+
+} // end of namespace klib
+
+#endif
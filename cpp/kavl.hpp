@@ -2,10 +2,12 @@
 #define KAVL_HPP
 
 #include <functional>
+#include <memory> // for std::allocator
+#include <new>    // for placement new
 
 namespace klib {
 
-template<class T, typename Less = std::less<T> >
+template<class T, typename Less = std::less<T>, class Alloc = std::allocator<T> >
 class Avl {
 	static const int MAX_DEPTH = 64;
 	struct Node {
@@ -14,7 +16,17 @@ class Avl {
 		unsigned size;
 		Node *p[2];
 	};
+#if __cplusplus >= 201103L
+	typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Node> node_alloc_t;
+#else
+	typedef typename Alloc::template rebind<Node>::other node_alloc_t;
+#endif
 	Node *root;
+	node_alloc_t node_alloc;
+	inline void free_node(Node *p) {
+		p->~Node();
+		node_alloc.deallocate(p, 1);
+	}
 	inline int cmp_func(const T &x, const T &y) {
 		return Less()(y, x) - Less()(x, y);
 	}
@@ -56,7 +68,7 @@ class Avl {
 		for (p = r; p; p = q) {
 			if (p->p[0] == 0) {
 				q = p->p[1];
-				delete p;
+				free_node(p);
 			} else {
 				q = p->p[0];
 				p->p[0] = q->p[1];
@@ -65,7 +77,7 @@ class Avl {
 		}
 	};
 public:
-	Avl() : root(NULL) {};
+	explicit Avl(const Alloc &a = Alloc()) : root(NULL), node_alloc(a) {};
 	~Avl() { destroy(root); };
 	unsigned size() const { return root? root->size : 0; }
 	T *find(const T &data, unsigned *cnt_ = NULL) {
@@ -104,7 +116,8 @@ public:
 			path[path_len++] = p;
 		}
 		if (cnt_) *cnt_ = cnt;
-		x = new Node;
+		if ((x = node_alloc.allocate(1)) == 0) return NULL; // out of memory; the tree is unchanged
+		x = new(x) Node();
 		x->data = data, x->balance = 0, x->size = 1, x->p[0] = x->p[1] = 0;
 		if (is_new) *is_new = true;
 		if (q == 0) root = x;
@@ -192,7 +205,7 @@ public:
 			}
 		}
 		root = fake.p[0];
-		delete p;
+		free_node(p);
 		return true;
 	};
 };
@@ -2,7 +2,8 @@
 #define __AC_KHASHL_HPP
 
 #include <functional> // for std::equal_to
-#include <cstdlib>    // for malloc() etc
+#include <memory>     // for std::allocator
+#include <new>        // for std::bad_alloc
 #include <cstring>    // for memset()
 #include <stdint.h>   // for uint32_t
 
@@ -29,15 +30,37 @@ int main(void)
 
 namespace klib {
 
+/* Alloc may either throw std::bad_alloc or return NULL when it runs out of
+ * memory. Either way, resize() returns -1 and put() returns end() with
+ * *absent set to -1, and the table is left unchanged. */
+template<class Alloc, class T>
+struct KHashAlloc {
+#if __cplusplus >= 201103L
+	typedef typename std::allocator_traits<Alloc>::template rebind_alloc<T> type;
+#else
+	typedef typename Alloc::template rebind<T>::other type;
+#endif
+	static inline T *allocate(type &a, size_t n) {
+		try { return a.allocate(n); }
+		catch (const std::bad_alloc&) { return 0; }
+	}
+};
+
 /***********
  * HashSet *
  ***********/
 
-template<class T, class Hash, class Eq = std::equal_to<T>, typename khint_t = uint32_t>
+template<class T, class Hash, class Eq = std::equal_to<T>, typename khint_t = uint32_t, class Alloc = std::allocator<T> >
 class KHashSet {
+	typedef KHashAlloc<Alloc, T> key_alloc_f;
+	typedef KHashAlloc<Alloc, uint32_t> used_alloc_f;
+	typedef typename key_alloc_f::type key_alloc_t;
+	typedef typename used_alloc_f::type used_alloc_t;
 	khint_t bits, count;
 	uint32_t *used;
 	T *keys;
+	key_alloc_t key_alloc;
+	used_alloc_t used_alloc;
 	static inline uint32_t __kh_used(const uint32_t *flag, khint_t i) { return flag[i>>5] >> (i&0x1fU) & 1U; };
 	static inline void __kh_set_used(uint32_t *flag, khint_t i) { flag[i>>5] |= 1U<<(i&0x1fU); };
 	static inline void __kh_set_unused(uint32_t *flag, khint_t i) { flag[i>>5] &= ~(1U<<(i&0x1fU)); };
@@ -45,8 +68,12 @@ class KHashSet {
 	static inline khint_t __kh_h2b(uint32_t hash, khint_t bits) { return hash * 2654435769U >> (32 - bits); }
 	static inline khint_t __kh_h2b(uint64_t hash, khint_t bits) { return hash * 11400714819323198485ULL >> (64 - bits); }
 public:
-	KHashSet() : bits(0), count(0), used(0), keys(0) {};
-	~KHashSet() { std::free(used); std::free(keys); };
+	explicit KHashSet(const Alloc &a = Alloc()) : bits(0), count(0), used(0), keys(0), key_alloc(a), used_alloc(a) {};
+	~KHashSet() {
+		if (!used) return;
+		used_alloc.deallocate(used, __kh_fsize(n_buckets()));
+		key_alloc.deallocate(keys, n_buckets());
+	};
 	inline khint_t n_buckets() const { return used? khint_t(1) << bits : 0; }
 	inline khint_t end() const { return n_buckets(); }
 	inline khint_t size() const { return count; }
@@ -71,19 +98,26 @@ public:
 	}
 	int resize(khint_t new_nb) {
 		uint32_t *new_used = 0;
+		T *new_keys = 0;
 		khint_t j = 0, x = new_nb, nb, new_bits, new_mask;
 		while ((x >>= khint_t(1)) != 0) ++j;
 		if (new_nb & (new_nb - 1)) ++j;
 		new_bits = j > 2? j : 2;
 		new_nb = khint_t(1) << new_bits;
 		if (count > (new_nb>>1) + (new_nb>>2)) return 0; /* requested size is too small */
-		new_used = (uint32_t*)std::malloc(__kh_fsize(new_nb) * sizeof(uint32_t));
-		memset(new_used, 0, __kh_fsize(new_nb) * sizeof(uint32_t));
+		new_used = used_alloc_f::allocate(used_alloc, __kh_fsize(new_nb));
 		if (!new_used) return -1; /* not enough memory */
+		memset(new_used, 0, __kh_fsize(new_nb) * sizeof(uint32_t));
 		nb = n_buckets();
+		if (nb != new_nb) { /* allocate before rehashing, such that a failure leaves the table intact */
+			new_keys = key_alloc_f::allocate(key_alloc, new_nb);
+			if (!new_keys) { used_alloc.deallocate(new_used, __kh_fsize(new_nb)); return -1; }
+		}
 		if (nb < new_nb) { /* expand */
-			T *new_keys = (T*)std::realloc(keys, new_nb * sizeof(T));
-			if (!new_keys) { std::free(new_used); return -1; }
+			if (keys) {
+				memcpy((void*)new_keys, (void*)keys, nb * sizeof(T));
+				key_alloc.deallocate(keys, nb);
+			}
 			keys = new_keys;
 		} /* otherwise shrink */
 		new_mask = new_nb - 1;
@@ -105,9 +139,12 @@ public:
 				}
 			}
 		}
-		if (nb > new_nb) /* shrink the hash table */
-			keys = (T*)std::realloc(keys, new_nb * sizeof(T));
-		std::free(used); /* free the working space */
+		if (nb > new_nb) { /* shrink the hash table */
+			memcpy((void*)new_keys, (void*)keys, new_nb * sizeof(T));
+			key_alloc.deallocate(keys, nb);
+			keys = new_keys;
+		}
+		if (used) used_alloc.deallocate(used, __kh_fsize(nb)); /* free the working space */
 		used = new_used, bits = new_bits;
 		return 0;
 	}
@@ -166,14 +203,15 @@ struct KHashMapHash { khint_t operator() (const T &a) const { return Hash()(a.ke
 template<class T, class Eq>
 struct KHashMapEq { bool operator() (const T &a, const T &b) const { return Eq()(a.key, b.key); } };
 
-template<class KType, class VType, class Hash, class Eq=std::equal_to<KType>, typename khint_t=uint32_t>
+template<class KType, class VType, class Hash, class Eq=std::equal_to<KType>, typename khint_t=uint32_t, class Alloc=std::allocator<KType> >
 class KHashMap : public KHashSet<KHashMapBucket<KType, VType>,
 		KHashMapHash<KHashMapBucket<KType, VType>, Hash, khint_t>,
-		KHashMapEq<KHashMapBucket<KType, VType>, Eq>, khint_t>
+		KHashMapEq<KHashMapBucket<KType, VType>, Eq>, khint_t, Alloc>
 {
 	typedef KHashMapBucket<KType, VType> bucket_t;
-	typedef KHashSet<bucket_t, KHashMapHash<bucket_t, Hash, khint_t>, KHashMapEq<bucket_t, Eq>, khint_t> hashset_t;
+	typedef KHashSet<bucket_t, KHashMapHash<bucket_t, Hash, khint_t>, KHashMapEq<bucket_t, Eq>, khint_t, Alloc> hashset_t;
 public:
+	explicit KHashMap(const Alloc &a = Alloc()) : hashset_t(a) {};
 	khint_t get(const KType &key) const {
 		bucket_t t = { key, VType() };
 		return hashset_t::get(t);
@@ -203,14 +241,15 @@ struct KHashCachedHash { khint_t operator() (const T &a) const { return a.hash;
 template<class T, class Eq>
 struct KHashCachedEq { bool operator() (const T &a, const T &b) const { return a.hash == b.hash && Eq()(a.key, b.key); } };
 
-template<class KType, class Hash, class Eq = std::equal_to<KType>, typename khint_t = uint32_t>
+template<class KType, class Hash, class Eq = std::equal_to<KType>, typename khint_t = uint32_t, class Alloc = std::allocator<KType> >
 class KHashSetCached : public KHashSet<KHashSetCachedBucket<KType, khint_t>,
 		KHashCachedHash<KHashSetCachedBucket<KType, khint_t>, khint_t>,
-		KHashCachedEq<KHashSetCachedBucket<KType, khint_t>, Eq>, khint_t>
+		KHashCachedEq<KHashSetCachedBucket<KType, khint_t>, Eq>, khint_t, Alloc>
 {
 	typedef KHashSetCachedBucket<KType, khint_t> bucket_t;
-	typedef KHashSet<bucket_t, KHashCachedHash<bucket_t, khint_t>, KHashCachedEq<bucket_t, Eq>, khint_t> hashset_t;
+	typedef KHashSet<bucket_t, KHashCachedHash<bucket_t, khint_t>, KHashCachedEq<bucket_t, Eq>, khint_t, Alloc> hashset_t;
 public:
+	explicit KHashSetCached(const Alloc &a = Alloc()) : hashset_t(a) {};
 	khint_t get(const KType &key) const {
 		bucket_t t = { key, Hash()(key) };
 		return hashset_t::get(t);
@@ -229,14 +268,15 @@ public:
 template<class KType, class VType, typename khint_t>
 struct KHashMapCachedBucket { KType key; VType val; khint_t hash; };
 
-template<class KType, class VType, class Hash, class Eq = std::equal_to<KType>, typename khint_t = uint32_t>
+template<class KType, class VType, class Hash, class Eq = std::equal_to<KType>, typename khint_t = uint32_t, class Alloc = std::allocator<KType> >
 class KHashMapCached : public KHashSet<KHashMapCachedBucket<KType, VType, khint_t>,
 		KHashCachedHash<KHashMapCachedBucket<KType, VType, khint_t>, khint_t>,
-		KHashCachedEq<KHashMapCachedBucket<KType, VType, khint_t>, Eq>, khint_t>
+		KHashCachedEq<KHashMapCachedBucket<KType, VType, khint_t>, Eq>, khint_t, Alloc>
 {
 	typedef KHashMapCachedBucket<KType, VType, khint_t> bucket_t;
-	typedef KHashSet<bucket_t, KHashCachedHash<bucket_t, khint_t>, KHashCachedEq<bucket_t, Eq>, khint_t> hashset_t;
+	typedef KHashSet<bucket_t, KHashCachedHash<bucket_t, khint_t>, KHashCachedEq<bucket_t, Eq>, khint_t, Alloc> hashset_t;
 public:
+	explicit KHashMapCached(const Alloc &a = Alloc()) : hashset_t(a) {};
 	khint_t get(const KType &key) const {
 		bucket_t t = { key, VType(), Hash()(key) };
 		return hashset_t::get(t);
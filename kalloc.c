@@ -1,32 +1,93 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#define KM_HAVE_MMAP
+#endif
 #include "kalloc.h"
 
+#define KM_TYPE_BASIC 0
+#define KM_TYPE_MT    1 // thread-safe front-end; see below
+#define KM_TYPE_ARENA 2 // bump-pointer arena; see below
+
+static void *kmt_malloc(void *_mt, size_t n_bytes);
+static void kmt_free(void *_mt, void *ap);
+static void *kmt_realloc(void *_mt, void *ap, size_t n_bytes);
+static void kmt_destroy(void *_mt);
+static void kmt_stat(const void *_mt, km_stat_t *s);
+
+static void *ka_malloc(void *_a, size_t n_bytes);
+static void ka_free(void *_a, void *ap);
+static void *ka_realloc(void *_a, void *ap, size_t n_bytes);
+static void ka_destroy(void *_a);
+static void ka_trim(void *_a);
+static void ka_stat(const void *_a, km_stat_t *s);
+
 /* In kalloc, a *core* is a large chunk of contiguous memory. Each core is
  * associated with a master header, which keeps the size of the current core
- * and the pointer to next core. Kalloc allocates small *blocks* of memory from
- * the cores and organizes free memory blocks in a circular single-linked list.
+ * and the pointer to next core, and ends with a zero-sized fence. Kalloc
+ * allocates *blocks* of memory from the cores. Block sizes are measured in
+ * units of sizeof(header_t). Each block starts with a size_t header that keeps
+ * the size and three flags: whether the block is free, whether the previous
+ * block is free and whether the block is the first in its core. A free block
+ * also keeps its size in its last size_t (the footer), such that adjacent free
+ * blocks can be merged in constant time. A core is completely free when its
+ * first block is free and followed by the fence.
  *
  * In the following diagram, "@" stands for the header of a free block (of type
- * header_t), "#" for the header of an allocated block (of type size_t), "-"
- * for free memory, and "+" for allocated memory.
+ * fblock_t), "#" for the header of an allocated block, "|" for the footer of a
+ * free block, "-" for free memory, "+" for allocated memory and "$" for the
+ * fence.
  *
- * master        This region is core 1.          master           This region is core 2.
+ *      *@------|#++++++#++++++++++++@-------|$       *@----------|#++++++++++++#+++++++$
  *      |                                             |
- *      *@-------#++++++#++++++++++++@--------        *@----------#++++++++++++#+++++++@------------
- *       |                           |                 |                               |
- *       p=p->ptr->ptr->ptr->ptr     p->ptr            p->ptr->ptr                     p->ptr->ptr->ptr
+ *      master of core 1                              master of core 2
+ *
+ * Free blocks are kept in doubly linked lists, one per size class. Size
+ * classes follow the two-level segregated fit scheme: the first level is the
+ * position of the most significant bit of the size and the second level
+ * divides each power-of-two range into KM_N_SL classes. Two levels of bitmaps
+ * record non-empty classes, so both kmalloc() and kfree() take constant time.
  */
 typedef struct header_t {
 	size_t size;
 	struct header_t *ptr;
 } header_t;
 
+typedef struct fblock_t {
+	size_t hdr;
+	struct fblock_t *next, *prev;
+} fblock_t;
+
+#define KM_SL_BITS   4
+#define KM_N_SL      (1<<KM_SL_BITS)
+#define KM_N_FL      40 /* good for sizes up to 2^(KM_N_FL+KM_SL_BITS-2) units */
+#define KM_MIN_UNITS 2  /* a free block needs room for fblock_t and the footer */
+
+#define KM_F_FREE    1  /* the block is free */
+#define KM_F_PFREE   2  /* the previous block is free */
+#define KM_F_FIRST   4  /* the first block in a core */
+#define km_hdr(p)    (*(size_t*)(p))
+#define km_size(p)   (km_hdr(p) >> 3)
+
+#define KM_HUGE_PAGE 0x200000
+
+struct km_prof_t;
+
 typedef struct {
+	int type; // KM_TYPE_BASIC; all allocator types start with this field
+	int flags; // KM_CORE_* flags
 	void *par;
+	struct km_prof_t *prof; // allocation profile; NULL if not profiling
 	size_t min_core_size;
-	header_t base, *loop_head, *core_head; /* base is a zero-sized block always kept in the loop */
+	header_t *core_head;
+	uint64_t fl_bitmap;
+	uint32_t sl_bitmap[KM_N_FL];
+	fblock_t *bin[KM_N_FL][KM_N_SL];
 } kmem_t;
 
 static void panic(const char *s)
@@ -35,123 +96,260 @@ static void panic(const char *s)
 	abort();
 }
 
+static void km_prof_alloc(kmem_t *km, size_t n_bytes, size_t n_units);
+static void km_prof_free(kmem_t *km, size_t n_units);
+static void km_prof_core(kmem_t *km, size_t n_units, int add);
+
 void *km_init2(void *km_par, size_t min_core_size)
 {
 	kmem_t *km;
 	km = (kmem_t*)kcalloc(km_par, 1, sizeof(kmem_t));
 	km->par = km_par;
-	if (km_par) km->min_core_size = min_core_size > 0? min_core_size : ((kmem_t*)km_par)->min_core_size - 2;
+	if (km_par && ((kmem_t*)km_par)->type == KM_TYPE_BASIC) km->min_core_size = min_core_size > 0? min_core_size : ((kmem_t*)km_par)->min_core_size - 3;
 	else km->min_core_size = min_core_size > 0? min_core_size : 0x80000;
 	return (void*)km;
 }
 
 void *km_init(void) { return km_init2(0, 0); }
 
+void *km_init3(void *km_par, size_t core_size, int flags)
+{
+	kmem_t *km;
+	km = (kmem_t*)km_init2(km_par, (core_size + sizeof(header_t) - 1) / sizeof(header_t));
+#ifdef KM_HAVE_MMAP
+	km->flags = flags;
+#else
+	km->flags = flags & KM_CORE_RELEASE;
+#endif
+	return km;
+}
+
+static void km_core_free(kmem_t *km, header_t *q)
+{
+#ifdef KM_HAVE_MMAP
+	if (km->flags & KM_CORE_MMAP) {
+		munmap(q, q->size * sizeof(header_t));
+		return;
+	}
+#endif
+	kfree(km->par, q);
+}
+
+static header_t *km_core_alloc(kmem_t *km, size_t *nu) /* allocate a core of at least *nu units; the actual size is written to *nu */
+{
+	header_t *q = 0;
+#ifdef KM_HAVE_MMAP
+	if (km->flags & KM_CORE_MMAP) {
+		size_t align = km->flags & (KM_CORE_HUGETLB|KM_CORE_THP)? KM_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+		size_t bytes = (*nu * sizeof(header_t) + align - 1) / align * align;
+		void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		if (km->flags & KM_CORE_HUGETLB) /* fails if no huge pages are reserved */
+			p = mmap(0, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+		if (p == MAP_FAILED) {
+			p = mmap(0, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED) return 0;
+#ifdef MADV_HUGEPAGE
+			if (km->flags & (KM_CORE_HUGETLB|KM_CORE_THP)) madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+		}
+		*nu = bytes / sizeof(header_t);
+		return (header_t*)p;
+	}
+#endif
+	q = (header_t*)kmalloc(km->par, *nu * sizeof(header_t));
+	return q;
+}
+
 void km_destroy(void *_km)
 {
 	kmem_t *km = (kmem_t*)_km;
 	void *km_par;
 	header_t *p, *q;
 	if (km == NULL) return;
+	if (km->type != KM_TYPE_BASIC) {
+		if (km->type == KM_TYPE_MT) kmt_destroy(km);
+		else ka_destroy(km);
+		return;
+	}
 	km_par = km->par;
+	km_prof(km, 0);
 	for (p = km->core_head; p != NULL;) {
 		q = p->ptr;
-		kfree(km_par, p);
+		km_core_free(km, p);
 		p = q;
 	}
 	kfree(km_par, km);
 }
 
-static header_t *morecore(kmem_t *km, size_t nu)
+static inline int km_msb(size_t n) /* position of the most significant bit; size_t may be wider than long */
+{
+	return 63 - __builtin_clzll((unsigned long long)n);
+}
+
+static inline size_t km_round(size_t n) /* round n up to the smallest size in the next class; any block there has at least n units */
+{
+	return n < KM_N_SL? n : n + ((size_t)1 << (km_msb(n) - KM_SL_BITS)) - 1;
+}
+
+static inline void km_mapping(size_t n, int *fl, int *sl) /* size class of n units */
+{
+	if (n < KM_N_SL) {
+		*fl = 0, *sl = n;
+	} else {
+		int b = km_msb(n);
+		*fl = b - KM_SL_BITS + 1;
+		*sl = (int)(n >> (b - KM_SL_BITS)) ^ KM_N_SL;
+		if (*fl >= KM_N_FL) panic("[kalloc] the block is too large");
+	}
+}
+
+static inline void km_insert(kmem_t *km, fblock_t *p, size_t n) /* add a free block of n units to its size class */
+{
+	int fl, sl;
+	fblock_t **b;
+	km_mapping(n, &fl, &sl);
+	b = &km->bin[fl][sl];
+	p->prev = 0, p->next = *b;
+	if (*b) (*b)->prev = p;
+	*b = p;
+	km->fl_bitmap |= 1ULL << fl;
+	km->sl_bitmap[fl] |= 1U << sl;
+}
+
+static inline void km_remove(kmem_t *km, fblock_t *p, size_t n)
+{
+	int fl, sl;
+	km_mapping(n, &fl, &sl);
+	if (p->next) p->next->prev = p->prev;
+	if (p->prev) p->prev->next = p->next;
+	else if ((km->bin[fl][sl] = p->next) == 0) {
+		km->sl_bitmap[fl] &= ~(1U << sl);
+		if (km->sl_bitmap[fl] == 0) km->fl_bitmap &= ~(1ULL << fl);
+	}
+}
+
+static inline fblock_t *km_search(kmem_t *km, size_t n) /* find a free block of at least n units and remove it */
 {
-	header_t *q;
-	size_t bytes, *p;
-	nu = (nu + 1 + (km->min_core_size - 1)) / km->min_core_size * km->min_core_size; /* the first +1 for core header */
-	bytes = nu * sizeof(header_t);
-	q = (header_t*)kmalloc(km->par, bytes);
+	int fl, sl;
+	uint32_t sl_map;
+	fblock_t *p;
+	km_mapping(km_round(n), &fl, &sl);
+	sl_map = km->sl_bitmap[fl] & (~0U << sl);
+	if (sl_map == 0) {
+		uint64_t fl_map = km->fl_bitmap & (~0ULL << (fl + 1));
+		if (fl_map == 0) return 0;
+		fl = __builtin_ctzll(fl_map);
+		sl_map = km->sl_bitmap[fl];
+	}
+	sl = __builtin_ctz(sl_map);
+	p = km->bin[fl][sl];
+	km_remove(km, p, km_size(p));
+	return p;
+}
+
+static inline void km_set_free(header_t *p, size_t n, size_t flags) /* mark p as a free block of n units */
+{
+	km_hdr(p) = n << 3 | KM_F_FREE | flags;
+	((size_t*)(p + n))[-1] = n; /* footer */
+	km_hdr(p + n) |= KM_F_PFREE;
+}
+
+static void morecore(kmem_t *km, size_t nu)
+{
+	header_t *q, *p;
+	nu = km_round(nu); /* the new free block must be found by km_search(nu) */
+	nu = (nu + 2 + (km->min_core_size - 1)) / km->min_core_size * km->min_core_size; /* +2 for the core header and the fence */
+	q = km_core_alloc(km, &nu);
 	if (!q) panic("[morecore] insufficient memory");
 	q->ptr = km->core_head, q->size = nu, km->core_head = q;
-	p = (size_t*)(q + 1);
-	*p = nu - 1; /* the size of the free block; -1 because the first unit is used for the core header */
-	kfree(km, p + 1); /* initialize the new "core"; NB: the core header is not looped. */
-	return km->loop_head;
+	if (km->prof) km_prof_core(km, nu, 1);
+	p = q + 1;
+	km_hdr(q + nu - 1) = 0; /* the fence: a zero-sized allocated block */
+	km_set_free(p, nu - 2, KM_F_FIRST);
+	km_insert(km, (fblock_t*)p, nu - 2);
 }
 
-void kfree(void *_km, void *ap) /* kfree() also adds a new core to the circular list */
+static int km_release_core(kmem_t *km, header_t *q) /* return a completely free core to the OS or the parent; keep the last core */
+{
+	header_t **r;
+	if (km->core_head == q && q->ptr == 0) return 0;
+	for (r = &km->core_head; *r != q; r = &(*r)->ptr);
+	*r = q->ptr;
+	if (km->prof) km_prof_core(km, q->size, 0);
+	km_core_free(km, q);
+	return 1;
+}
+
+void kfree(void *_km, void *ap)
 {
-	header_t *p, *q;
 	kmem_t *km = (kmem_t*)_km;
-	
+	header_t *p, *q;
+	size_t n, h;
+
 	if (!ap) return;
 	if (km == NULL) {
 		free(ap);
 		return;
 	}
+	if (km->type != KM_TYPE_BASIC) {
+		if (km->type == KM_TYPE_MT) kmt_free(km, ap);
+		else ka_free(km, ap);
+		return;
+	}
 	p = (header_t*)((size_t*)ap - 1);
-	p->size = *((size_t*)ap - 1);
-	/* Find the pointer that points to the block to be freed. The following loop can stop on two conditions:
-	 *
-	 * a) "p>q && p<q->ptr": @------#++++++++#+++++++@-------    @---------------#+++++++@-------
-	 *    (can also be in    |      |                |        -> |                       |
-	 *     two cores)        q      p           q->ptr           q                  q->ptr
-	 *
-	 *                       @--------    #+++++++++@--------    @--------    @------------------
-	 *                       |            |         |         -> |            |
-	 *                       q            p    q->ptr            q       q->ptr
-	 *
-	 * b) "q>=q->ptr && (p>q || p<q->ptr)":  @-------#+++++   @--------#+++++++     @-------#+++++   @----------------
-	 *                                       |                |        |         -> |                |
-	 *                                  q->ptr                q        p       q->ptr                q
-	 *
-	 *                                       #+++++++@-----   #++++++++@-------     @-------------   #++++++++@-------
-	 *                                       |       |                 |         -> |                         |
-	 *                                       p  q->ptr                 q       q->ptr                         q
-	 */
-	for (q = km->loop_head; !(p > q && p < q->ptr); q = q->ptr)
-		if (q >= q->ptr && (p > q || p < q->ptr)) break;
-	if (p + p->size == q->ptr) { /* two adjacent blocks, merge p and q->ptr (the 2nd and 4th cases) */
-		p->size += q->ptr->size;
-		p->ptr = q->ptr->ptr;
-	} else if (p + p->size > q->ptr && q->ptr >= p) {
-		panic("[kfree] The end of the allocated block enters a free block.");
-	} else p->ptr = q->ptr; /* backup q->ptr */
-
-	if (q + q->size == p) { /* two adjacent blocks, merge q and p (the other two cases) */
-		q->size += p->size;
-		q->ptr = p->ptr;
-		km->loop_head = q;
-	} else if (q + q->size > p && p >= q) {
-		panic("[kfree] The end of a free block enters the allocated block.");
-	} else km->loop_head = p, q->ptr = p; /* in two cores, cannot be merged; create a new block in the list */
+	h = km_hdr(p), n = h >> 3;
+	if (h & KM_F_FREE) panic("[kfree] The block has been freed.");
+	if (km->prof) km_prof_free(km, n);
+	q = p + n;
+	if (km_hdr(q) & KM_F_FREE) { /* merge with the next block */
+		km_remove(km, (fblock_t*)q, km_size(q));
+		n += km_size(q);
+	}
+	if (h & KM_F_PFREE) { /* merge with the previous block */
+		size_t m = ((size_t*)p)[-1];
+		p -= m;
+		if (km_size(p) != m || !(km_hdr(p) & KM_F_FREE))
+			panic("[kfree] The previous free block is corrupted.");
+		km_remove(km, (fblock_t*)p, m);
+		n += m;
+	}
+	if ((km->flags & KM_CORE_RELEASE) && (km_hdr(p) & KM_F_FIRST) && km_size(p + n) == 0 && km_release_core(km, p - 1))
+		return;
+	km_set_free(p, n, km_hdr(p) & (KM_F_PFREE|KM_F_FIRST));
+	km_insert(km, (fblock_t*)p, n);
 }
 
 void *kmalloc(void *_km, size_t n_bytes)
 {
 	kmem_t *km = (kmem_t*)_km;
-	size_t n_units;
-	header_t *p, *q;
+	size_t n_units, m;
+	header_t *p;
 
 	if (n_bytes == 0) return 0;
 	if (km == NULL) return malloc(n_bytes);
+	if (km->type != KM_TYPE_BASIC)
+		return km->type == KM_TYPE_MT? kmt_malloc(km, n_bytes) : ka_malloc(km, n_bytes);
 	n_units = (n_bytes + sizeof(size_t) + sizeof(header_t) - 1) / sizeof(header_t); /* header+n_bytes requires at least this number of units */
+	if (n_units < KM_MIN_UNITS) n_units = KM_MIN_UNITS;
 
-	if (!(q = km->loop_head)) /* the first time when kmalloc() is called, intialize it */
-		q = km->loop_head = km->base.ptr = &km->base;
-	for (p = q->ptr;; q = p, p = p->ptr) { /* search for a suitable block */
-		if (p->size >= n_units) { /* p->size if the size of current block. This line means the current block is large enough. */
-			if (p->size == n_units) q->ptr = p->ptr; /* no need to split the block */
-			else { /* split the block. NB: memory is allocated at the end of the block! */
-				p->size -= n_units; /* reduce the size of the free block */
-				p += p->size; /* p points to the allocated block */
-				*(size_t*)p = n_units; /* set the size */
-			}
-			km->loop_head = q; /* set the end of chain */
-			return (size_t*)p + 1;
-		}
-		if (p == km->loop_head) { /* then ask for more "cores" */
-			if ((p = morecore(km, n_units)) == 0) return 0;
-		}
+	if ((p = (header_t*)km_search(km, n_units)) == 0) {
+		morecore(km, n_units);
+		if ((p = (header_t*)km_search(km, n_units)) == 0)
+			panic("[kmalloc] failed to find a block in the new core");
 	}
+	m = km_size(p);
+	if (m - n_units >= KM_MIN_UNITS) { /* split the block; the rest goes back to the bins */
+		km_set_free(p + n_units, m - n_units, 0);
+		km_insert(km, (fblock_t*)(p + n_units), m - n_units);
+	} else { /* use the whole block */
+		n_units = m;
+		km_hdr(p + m) &= ~(size_t)KM_F_PFREE;
+	}
+	km_hdr(p) = n_units << 3 | (km_hdr(p) & (KM_F_PFREE|KM_F_FIRST));
+	if (km->prof) km_prof_alloc(km, n_bytes, n_units);
+	return (size_t*)p + 1;
 }
 
 void *kcalloc(void *_km, size_t count, size_t size)
@@ -175,8 +373,10 @@ void *krealloc(void *_km, void *ap, size_t n_bytes) // TODO: this can be made mo
 	}
 	if (km == NULL) return realloc(ap, n_bytes);
 	if (ap == NULL) return kmalloc(km, n_bytes);
+	if (km->type != KM_TYPE_BASIC)
+		return km->type == KM_TYPE_MT? kmt_realloc(km, ap, n_bytes) : ka_realloc(km, ap, n_bytes);
 	p = (size_t*)ap - 1;
-	cap = (*p) * sizeof(header_t) - sizeof(size_t);
+	cap = km_size(p) * sizeof(header_t) - sizeof(size_t);
 	if (cap >= n_bytes) return ap; /* TODO: this prevents shrinking */
 	q = (size_t*)kmalloc(km, n_bytes);
 	memcpy(q, ap, cap);
@@ -194,18 +394,61 @@ void *krelocate(void *km, void *ap, size_t n_bytes)
 	return p;
 }
 
+void km_trim(void *_km)
+{
+	kmem_t *km = (kmem_t*)_km;
+	int fl, sl;
+	if (km && km->type == KM_TYPE_ARENA) ka_trim(km);
+	if (km == NULL || km->type != KM_TYPE_BASIC) return;
+	for (fl = 0; fl < KM_N_FL; ++fl) {
+		for (sl = 0; sl < KM_N_SL; ++sl) {
+			fblock_t *b, *next;
+			for (b = km->bin[fl][sl]; b; b = next) {
+				header_t *p = (header_t*)b;
+				size_t n = km_size(p);
+				next = b->next;
+				if ((km_hdr(p) & KM_F_FIRST) && km_size(p + n) == 0 && (km->core_head != p - 1 || km->core_head->ptr)) {
+					km_remove(km, b, n);
+					km_release_core(km, p - 1);
+					continue;
+				}
+#ifdef KM_HAVE_MMAP
+				if (km->flags & KM_CORE_MMAP) { /* drop the pages in the middle of the free block */
+					size_t pg = km->flags & (KM_CORE_HUGETLB|KM_CORE_THP)? KM_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+					uintptr_t st = ((uintptr_t)(b + 1) + pg - 1) / pg * pg;
+					uintptr_t en = ((uintptr_t)(p + n) - sizeof(size_t)) / pg * pg;
+					if (st < en) madvise((void*)st, en - st, MADV_DONTNEED);
+				}
+#endif
+			}
+		}
+	}
+}
+
 void km_stat(const void *_km, km_stat_t *s)
 {
 	kmem_t *km = (kmem_t*)_km;
 	header_t *p;
+	int fl, sl;
 	memset(s, 0, sizeof(km_stat_t));
-	if (km == NULL || km->loop_head == NULL) return;
-	for (p = km->loop_head;; p = p->ptr) {
-		s->available += p->size * sizeof(header_t);
-		if (p->size != 0) ++s->n_blocks; /* &kmem_t::base is always one of the cores. It is zero-sized. */
-		if (p->ptr > p && p + p->size > p->ptr)
-			panic("[km_stat] The end of a free block enters another free block.");
-		if (p->ptr == km->loop_head) break;
+	if (km && km->type != KM_TYPE_BASIC) {
+		if (km->type == KM_TYPE_MT) kmt_stat(km, s);
+		else ka_stat(km, s);
+		return;
+	}
+	if (km == NULL) return;
+	for (fl = 0; fl < KM_N_FL; ++fl) {
+		for (sl = 0; sl < KM_N_SL; ++sl) {
+			fblock_t *b;
+			for (b = km->bin[fl][sl]; b; b = b->next) {
+				size_t n = km_size(b);
+				s->available += n * sizeof(header_t);
+				++s->n_blocks;
+				p = (header_t*)b + n;
+				if (!(km_hdr(b) & KM_F_FREE) || (km_hdr(p) & KM_F_FREE) || !(km_hdr(p) & KM_F_PFREE))
+					panic("[km_stat] The free block is corrupted or not merged.");
+			}
+		}
 	}
 	for (p = km->core_head; p != NULL; p = p->ptr) {
 		size_t size = p->size * sizeof(header_t);
@@ -215,10 +458,549 @@ void km_stat(const void *_km, km_stat_t *s)
 	}
 }
 
+/*************
+ * Profiling *
+ *************/
+
+/* With profiling on, kmalloc() and kfree() of a basic allocator update byte
+ * counts and a histogram of requested sizes. Every allocation is attributed
+ * to the current tag set by km_tag(). As blocks do not record their tags,
+ * frees are not attributed. The bytes in use and the capacity are sampled at
+ * intervals of calls; when the sample buffer is full, every other sample is
+ * dropped and the interval is doubled, such that the samples always span the
+ * whole run. */
+
+#define KM_PROF_N_BIN    48
+#define KM_PROF_N_SAMPLE 64
+
+typedef struct {
+	const char *name;
+	int64_t n_alloc, bytes;
+} km_ptag_t;
+
+typedef struct {
+	int64_t n_calls;
+	size_t in_use, capacity;
+} km_sample_t;
+
+typedef struct km_prof_t {
+	int64_t n_alloc, n_free, bytes; // bytes requested
+	size_t in_use, peak, capacity; // in_use and peak include block headers and padding
+	int64_t n_bin[KM_PROF_N_BIN], b_bin[KM_PROF_N_BIN];
+	int cur_tag, n_tag, m_tag;
+	km_ptag_t *tag;
+	int n_sample;
+	int64_t interval;
+	km_sample_t sample[KM_PROF_N_SAMPLE];
+} km_prof_t;
+
+static void km_prof_sample(km_prof_t *pf)
+{
+	km_sample_t *s;
+	if (pf->n_sample == KM_PROF_N_SAMPLE) { // halve the resolution
+		int i;
+		for (i = 0; i < KM_PROF_N_SAMPLE / 2; ++i)
+			pf->sample[i] = pf->sample[i * 2 + 1];
+		pf->n_sample = KM_PROF_N_SAMPLE / 2;
+		pf->interval <<= 1;
+	}
+	s = &pf->sample[pf->n_sample++];
+	s->n_calls = pf->n_alloc + pf->n_free;
+	s->in_use = pf->in_use, s->capacity = pf->capacity;
+}
+
+static void km_prof_alloc(kmem_t *km, size_t n_bytes, size_t n_units)
+{
+	km_prof_t *pf = km->prof;
+	int b = n_bytes > 1? km_msb(n_bytes - 1) + 1 : 0; // n_bytes in (2^(b-1),2^b]
+	if (b >= KM_PROF_N_BIN) b = KM_PROF_N_BIN - 1;
+	++pf->n_alloc, pf->bytes += n_bytes;
+	++pf->n_bin[b], pf->b_bin[b] += n_bytes;
+	++pf->tag[pf->cur_tag].n_alloc, pf->tag[pf->cur_tag].bytes += n_bytes;
+	pf->in_use += n_units * sizeof(header_t);
+	if (pf->in_use > pf->peak) pf->peak = pf->in_use;
+	if ((pf->n_alloc + pf->n_free) % pf->interval == 0) km_prof_sample(pf);
+}
+
+static void km_prof_free(kmem_t *km, size_t n_units)
+{
+	km_prof_t *pf = km->prof;
+	++pf->n_free;
+	pf->in_use -= n_units * sizeof(header_t);
+	if ((pf->n_alloc + pf->n_free) % pf->interval == 0) km_prof_sample(pf);
+}
+
+static void km_prof_core(kmem_t *km, size_t n_units, int add)
+{
+	if (add) km->prof->capacity += n_units * sizeof(header_t);
+	else km->prof->capacity -= n_units * sizeof(header_t);
+}
+
+void km_prof(void *_km, int on)
+{
+	kmem_t *km = (kmem_t*)_km;
+	if (km == NULL || km->type != KM_TYPE_BASIC) return;
+	if (on && km->prof == 0) {
+		km_stat_t st;
+		km_prof_t *pf;
+		km_stat(km, &st);
+		pf = Kcalloc(km->par, km_prof_t, 1);
+		pf->capacity = st.capacity;
+		pf->in_use = pf->peak = st.capacity - st.available - st.n_cores * 2 * sizeof(header_t); // blocks allocated before profiling
+		pf->interval = 1024;
+		pf->n_tag = pf->m_tag = 1;
+		pf->tag = Kcalloc(km->par, km_ptag_t, 1);
+		pf->tag[0].name = "(untagged)";
+		km->prof = pf;
+	} else if (!on && km->prof) {
+		kfree(km->par, km->prof->tag);
+		kfree(km->par, km->prof);
+		km->prof = 0;
+	}
+}
+
+void km_tag(void *_km, const char *tag)
+{
+	kmem_t *km = (kmem_t*)_km;
+	km_prof_t *pf;
+	int i;
+	if (km == NULL || km->type != KM_TYPE_BASIC || km->prof == 0) return;
+	pf = km->prof;
+	if (tag == 0) {
+		pf->cur_tag = 0;
+		return;
+	}
+	for (i = 1; i < pf->n_tag; ++i) // tags are few; compare pointers first as tags are usually literals
+		if (pf->tag[i].name == tag || strcmp(pf->tag[i].name, tag) == 0) break;
+	if (i == pf->n_tag) {
+		if (pf->n_tag == pf->m_tag) Kexpand(km->par, km_ptag_t, pf->tag, pf->m_tag);
+		pf->tag[pf->n_tag].name = tag;
+		pf->tag[pf->n_tag].n_alloc = pf->tag[pf->n_tag].bytes = 0;
+		++pf->n_tag;
+	}
+	pf->cur_tag = i;
+}
+
+int km_prof_stat(const void *_km, km_prof_stat_t *s)
+{
+	const kmem_t *km = (const kmem_t*)_km;
+	const km_prof_t *pf;
+	memset(s, 0, sizeof(km_prof_stat_t));
+	if (km == NULL || km->type != KM_TYPE_BASIC || km->prof == 0) return -1;
+	pf = km->prof;
+	s->n_alloc = pf->n_alloc, s->n_free = pf->n_free, s->bytes = pf->bytes;
+	s->in_use = pf->in_use, s->peak = pf->peak, s->capacity = pf->capacity;
+	return 0;
+}
+
+int km_prof_tag(const void *_km, const char *tag, long *n_alloc, long *bytes)
+{
+	const kmem_t *km = (const kmem_t*)_km;
+	int i;
+	*n_alloc = *bytes = 0;
+	if (km == NULL || km->type != KM_TYPE_BASIC || km->prof == 0 || tag == 0) return -1;
+	for (i = 1; i < km->prof->n_tag; ++i)
+		if (km->prof->tag[i].name == tag || strcmp(km->prof->tag[i].name, tag) == 0) break;
+	if (i == km->prof->n_tag) return -1;
+	*n_alloc = km->prof->tag[i].n_alloc, *bytes = km->prof->tag[i].bytes;
+	return 0;
+}
+
+static void km_prof_print(const km_prof_t *pf)
+{
+	int i;
+	fprintf(stderr, "[km_prof] n_alloc=%ld, n_free=%ld, bytes=%ld, in_use=%ld, peak=%ld, cap=%ld\n",
+			(long)pf->n_alloc, (long)pf->n_free, (long)pf->bytes, (long)pf->in_use, (long)pf->peak, (long)pf->capacity);
+	for (i = 0; i < KM_PROF_N_BIN; ++i)
+		if (pf->n_bin[i])
+			fprintf(stderr, "[km_prof] size<=%-12lu n_alloc=%-10ld bytes=%ld\n", 1UL << i, (long)pf->n_bin[i], (long)pf->b_bin[i]);
+	for (i = 0; i < pf->n_tag; ++i)
+		if (pf->tag[i].n_alloc)
+			fprintf(stderr, "[km_prof] tag=%s n_alloc=%ld bytes=%ld\n", pf->tag[i].name, (long)pf->tag[i].n_alloc, (long)pf->tag[i].bytes);
+	for (i = 0; i < pf->n_sample; ++i) { // fragmentation: the fraction of the capacity not in use
+		const km_sample_t *s = &pf->sample[i];
+		fprintf(stderr, "[km_prof] n_calls=%-12ld in_use=%-12ld cap=%-12ld frag=%.3f\n", (long)s->n_calls, (long)s->in_use, (long)s->capacity,
+				s->capacity? 1.0 - (double)s->in_use / s->capacity : 0.0);
+	}
+}
+
 void km_stat_print(const void *km)
 {
 	km_stat_t st;
 	km_stat(km, &st);
 	fprintf(stderr, "[km_stat] cap=%ld, avail=%ld, largest=%ld, n_core=%ld, n_block=%ld\n",
-			st.capacity, st.available, st.largest, st.n_blocks, st.n_cores);
+			st.capacity, st.available, st.largest, st.n_cores, st.n_blocks);
+	if (km && ((const kmem_t*)km)->type == KM_TYPE_BASIC && ((const kmem_t*)km)->prof)
+		km_prof_print(((const kmem_t*)km)->prof);
+}
+
+/********************************
+ * Thread-safe caching frontend *
+ ********************************/
+
+/* A thread-safe allocator consists of one shared kmem_t guarded by a mutex
+ * and a heap per thread. A heap carves small blocks from regions taken from
+ * the shared pool and keeps freed blocks in per-size-class free lists. A block
+ * freed by a thread other than its owner is queued to a pending batch, which
+ * is pushed to the owner's lock-free remote-free stack with one CAS. The owner
+ * drains the stack when a free list runs empty. Large blocks go to the shared
+ * pool directly. Heaps of exited threads are adopted by new threads. */
+
+#define KMT_N_CLASS   64
+#define KMT_MAX_SMALL 32768
+#define KMT_REGION    0x40000
+#define KMT_BATCH     64
+
+struct kmt_heap_t;
+
+typedef struct {
+	struct kmt_heap_t *h; // owner heap; NULL for large blocks
+	size_t size; // usable size
+} kmt_hdr_t;
+
+typedef struct kmt_link_t {
+	struct kmt_link_t *next;
+} kmt_link_t;
+
+typedef struct kmt_heap_t {
+	struct kmt_heap_t *next; // in the list of all heaps
+	int in_use; // 0 if the owner thread has exited
+	kmt_link_t *free[KMT_N_CLASS];
+	kmt_link_t *volatile remote; // blocks freed by other threads
+	uint8_t *reg, *reg_end; // current region
+	struct kmt_heap_t *p_owner; // pending remote frees, all owned by p_owner
+	kmt_link_t *p_head, *p_tail;
+	int p_n;
+	struct kmt_t *mt;
+} kmt_heap_t;
+
+typedef struct kmt_t {
+	int type; // KM_TYPE_MT
+	void *km; // the shared pool
+	kmt_heap_t *heaps;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+} kmt_t;
+
+static inline int kmt_class(size_t n) // 4 classes per power of 2; n<=KMT_MAX_SMALL
+{
+	int b;
+	if (n <= 64) return n <= 16? 0 : (n - 1) >> 4; // 16, 32, 48, 64
+	b = km_msb(n - 1); // 2^b < n <= 2^(b+1)
+	return 4 + (b - 6) * 4 + (int)((n - 1) >> (b - 2) & 3);
+}
+
+static inline size_t kmt_class_size(int c)
+{
+	int b;
+	if (c < 4) return (size_t)(c + 1) << 4;
+	b = (c - 4) / 4 + 6;
+	return ((size_t)1 << b) + ((size_t)((c - 4) % 4 + 1) << (b - 2));
+}
+
+static void kmt_flush(kmt_heap_t *h) // push pending remote frees to their owner
+{
+	kmt_link_t *old;
+	if (h->p_n == 0) return;
+	do {
+		old = __atomic_load_n(&h->p_owner->remote, __ATOMIC_RELAXED);
+		h->p_tail->next = old;
+	} while (!__sync_bool_compare_and_swap(&h->p_owner->remote, old, h->p_head));
+	h->p_owner = 0, h->p_head = h->p_tail = 0, h->p_n = 0;
+}
+
+static void kmt_drain(kmt_heap_t *h) // move remotely freed blocks to local free lists
+{
+	kmt_link_t *p, *q;
+	if (__atomic_load_n(&h->remote, __ATOMIC_RELAXED) == 0) return;
+	for (p = __atomic_exchange_n(&h->remote, 0, __ATOMIC_ACQUIRE); p; p = q) {
+		int c = kmt_class(((kmt_hdr_t*)p - 1)->size);
+		q = p->next;
+		p->next = h->free[c], h->free[c] = p;
+	}
+}
+
+static void kmt_thread_exit(void *_h)
+{
+	kmt_heap_t *h = (kmt_heap_t*)_h;
+	kmt_flush(h);
+	pthread_mutex_lock(&h->mt->lock);
+	h->in_use = 0;
+	pthread_mutex_unlock(&h->mt->lock);
+}
+
+static kmt_heap_t *kmt_heap(kmt_t *mt) // get the heap of the calling thread
+{
+	kmt_heap_t *h;
+	if ((h = (kmt_heap_t*)pthread_getspecific(mt->key)) != 0) return h;
+	pthread_mutex_lock(&mt->lock);
+	for (h = mt->heaps; h && h->in_use; h = h->next);
+	if (h == 0) { // no heaps to adopt
+		h = Kcalloc(mt->km, kmt_heap_t, 1);
+		h->mt = mt, h->next = mt->heaps, mt->heaps = h;
+	}
+	h->in_use = 1;
+	pthread_mutex_unlock(&mt->lock);
+	pthread_setspecific(mt->key, h);
+	return h;
+}
+
+void *km_init_mt(void)
+{
+	kmt_t *mt;
+	mt = (kmt_t*)calloc(1, sizeof(kmt_t));
+	if (mt == 0) return 0;
+	if (pthread_key_create(&mt->key, kmt_thread_exit) != 0) { // out of keys
+		free(mt);
+		return 0;
+	}
+	mt->type = KM_TYPE_MT;
+	mt->km = km_init();
+	pthread_mutex_init(&mt->lock, 0);
+	return mt;
+}
+
+static void kmt_destroy(void *_mt)
+{
+	kmt_t *mt = (kmt_t*)_mt;
+	pthread_key_delete(mt->key);
+	pthread_mutex_destroy(&mt->lock);
+	km_destroy(mt->km); // this frees all heaps and blocks
+	free(mt);
+}
+
+static void *kmt_malloc(void *_mt, size_t n_bytes)
+{
+	kmt_t *mt = (kmt_t*)_mt;
+	kmt_heap_t *h;
+	kmt_hdr_t *p;
+	kmt_link_t *q;
+	size_t size;
+	int c;
+	if (n_bytes > KMT_MAX_SMALL) {
+		pthread_mutex_lock(&mt->lock);
+		p = (kmt_hdr_t*)kmalloc(mt->km, sizeof(kmt_hdr_t) + n_bytes);
+		pthread_mutex_unlock(&mt->lock);
+		p->h = 0, p->size = n_bytes;
+		return p + 1;
+	}
+	h = kmt_heap(mt);
+	c = kmt_class(n_bytes);
+	if (h->free[c] == 0) kmt_drain(h);
+	if ((q = h->free[c]) != 0) {
+		h->free[c] = q->next;
+		return q;
+	}
+	size = sizeof(kmt_hdr_t) + kmt_class_size(c);
+	if (h->reg + size > h->reg_end) { // get a new region from the shared pool; the rest of the old region is wasted
+		kmt_flush(h); // a good time to hand over pending remote frees
+		pthread_mutex_lock(&mt->lock);
+		h->reg = (uint8_t*)kmalloc(mt->km, KMT_REGION);
+		pthread_mutex_unlock(&mt->lock);
+		h->reg_end = h->reg + KMT_REGION;
+	}
+	p = (kmt_hdr_t*)h->reg;
+	h->reg += size;
+	p->h = h, p->size = kmt_class_size(c);
+	return p + 1;
+}
+
+static void kmt_free(void *_mt, void *ap)
+{
+	kmt_t *mt = (kmt_t*)_mt;
+	kmt_hdr_t *p = (kmt_hdr_t*)ap - 1;
+	kmt_link_t *q = (kmt_link_t*)ap;
+	kmt_heap_t *h;
+	if (p->h == 0) { // large block
+		pthread_mutex_lock(&mt->lock);
+		kfree(mt->km, p);
+		pthread_mutex_unlock(&mt->lock);
+		return;
+	}
+	h = kmt_heap(mt);
+	if (p->h == h) { // local free
+		int c = kmt_class(p->size);
+		q->next = h->free[c], h->free[c] = q;
+		return;
+	}
+	if (h->p_owner != p->h || h->p_n == KMT_BATCH) kmt_flush(h);
+	if (h->p_n == 0) h->p_owner = p->h, h->p_tail = q;
+	q->next = h->p_head, h->p_head = q, ++h->p_n;
+}
+
+static void *kmt_realloc(void *_mt, void *ap, size_t n_bytes)
+{
+	kmt_hdr_t *p = (kmt_hdr_t*)ap - 1;
+	void *q;
+	if (p->size >= n_bytes) return ap;
+	q = kmt_malloc(_mt, n_bytes);
+	memcpy(q, ap, p->size);
+	kmt_free(_mt, ap);
+	return q;
+}
+
+static void kmt_stat(const void *_mt, km_stat_t *s)
+{
+	kmt_t *mt = (kmt_t*)_mt;
+	pthread_mutex_lock(&mt->lock);
+	km_stat(mt->km, s); // blocks cached in heaps are counted as used
+	pthread_mutex_unlock(&mt->lock);
+}
+
+/*************************
+ * Bump-pointer arena *
+ *************************/
+
+/* An arena hands out memory from large chunks by bumping an offset. Each
+ * allocation is preceded by its size, such that krealloc() knows how much to
+ * copy. kfree() is a no-op except for the most recent allocation, which is
+ * rolled back; krealloc() on the most recent allocation grows it in place.
+ * km_release_to_mark() and km_reset() keep released chunks for reuse; they
+ * are returned to the parent allocator by km_trim() or km_destroy(). */
+
+typedef struct ka_chunk_t {
+	struct ka_chunk_t *next; // the previous chunk in use, or the next spare chunk
+	size_t size; // size of the data area
+} ka_chunk_t;
+
+typedef struct {
+	int type; // KM_TYPE_ARENA
+	void *par;
+	size_t chunk_size;
+	ka_chunk_t *cur, *spare; // the chunk in use; cached chunks
+	size_t off; // offset of the next allocation in cur
+	size_t *last; // header of the most recent allocation; NULL if unknown
+} karena_t;
+
+#define ka_data(c) ((uint8_t*)((c) + 1))
+
+void *km_init_arena(void *km_par, size_t chunk_size)
+{
+	karena_t *a;
+	a = Kcalloc(km_par, karena_t, 1);
+	a->type = KM_TYPE_ARENA;
+	a->par = km_par;
+	a->chunk_size = chunk_size > 0? chunk_size : 0x10000;
+	return a;
+}
+
+static void ka_free_chunks(karena_t *a, ka_chunk_t *c)
+{
+	while (c) {
+		ka_chunk_t *next = c->next;
+		kfree(a->par, c);
+		c = next;
+	}
+}
+
+static void ka_destroy(void *_a)
+{
+	karena_t *a = (karena_t*)_a;
+	ka_free_chunks(a, a->cur);
+	ka_free_chunks(a, a->spare);
+	kfree(a->par, a);
+}
+
+static void ka_trim(void *_a)
+{
+	karena_t *a = (karena_t*)_a;
+	ka_free_chunks(a, a->spare);
+	a->spare = 0;
+}
+
+static void *ka_malloc(void *_a, size_t n_bytes)
+{
+	karena_t *a = (karena_t*)_a;
+	size_t need = (n_bytes + 2 * sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t); // size header + n_bytes, rounded up
+	size_t *p;
+	if (a->cur == 0 || a->off + need > a->cur->size) { // start a new chunk
+		ka_chunk_t *c, **r;
+		for (r = &a->spare; *r && (*r)->size < need; r = &(*r)->next);
+		if (*r) {
+			c = *r, *r = c->next;
+		} else {
+			size_t size = need > a->chunk_size? need : a->chunk_size;
+			c = (ka_chunk_t*)kmalloc(a->par, sizeof(ka_chunk_t) + size);
+			if (c == 0) return 0;
+			c->size = size;
+		}
+		c->next = a->cur, a->cur = c, a->off = 0;
+	}
+	p = (size_t*)(ka_data(a->cur) + a->off);
+	a->off += need;
+	*p = n_bytes;
+	a->last = p;
+	return p + 1;
+}
+
+static void ka_free(void *_a, void *ap)
+{
+	karena_t *a = (karena_t*)_a;
+	size_t *p = (size_t*)ap - 1;
+	if (p == a->last) { // roll back the most recent allocation
+		a->off = (uint8_t*)p - ka_data(a->cur);
+		a->last = 0;
+	}
+}
+
+static void *ka_realloc(void *_a, void *ap, size_t n_bytes)
+{
+	karena_t *a = (karena_t*)_a;
+	size_t *p = (size_t*)ap - 1, *q;
+	if (*p >= n_bytes) return ap;
+	if (p == a->last) { // try to grow in place
+		size_t st = (uint8_t*)p - ka_data(a->cur);
+		size_t need = (n_bytes + 2 * sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+		if (st + need <= a->cur->size) {
+			a->off = st + need, *p = n_bytes;
+			return ap;
+		}
+	}
+	q = (size_t*)ka_malloc(a, n_bytes);
+	if (q) memcpy(q, ap, *p);
+	return q;
+}
+
+static void ka_stat(const void *_a, km_stat_t *s)
+{
+	const karena_t *a = (const karena_t*)_a;
+	const ka_chunk_t *c;
+	for (c = a->cur; c; c = c->next) {
+		++s->n_cores, s->capacity += c->size;
+		s->largest = s->largest > c->size? s->largest : c->size;
+	}
+	if (a->cur) s->available += a->cur->size - a->off, ++s->n_blocks;
+	for (c = a->spare; c; c = c->next) {
+		++s->n_cores, ++s->n_blocks, s->capacity += c->size, s->available += c->size;
+		s->largest = s->largest > c->size? s->largest : c->size;
+	}
+}
+
+km_mark_t km_mark(void *km)
+{
+	karena_t *a = (karena_t*)km;
+	km_mark_t m = { 0, 0 };
+	if (a && a->type == KM_TYPE_ARENA)
+		m.chunk = a->cur, m.off = a->off;
+	return m;
+}
+
+void km_release_to_mark(void *km, km_mark_t m)
+{
+	karena_t *a = (karena_t*)km;
+	if (a == 0 || a->type != KM_TYPE_ARENA) return;
+	while (a->cur != (ka_chunk_t*)m.chunk) { // move chunks allocated after the mark to the spare list
+		ka_chunk_t *c = a->cur;
+		if (c == 0) panic("[km_release_to_mark] invalid mark");
+		a->cur = c->next;
+		c->next = a->spare, a->spare = c;
+	}
+	a->off = m.off;
+	a->last = 0;
+}
+
+void km_reset(void *km)
+{
+	km_mark_t m = { 0, 0 };
+	km_release_to_mark(km, m);
 }
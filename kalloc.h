@@ -11,6 +11,16 @@ typedef struct {
 	size_t capacity, available, n_blocks, n_cores, largest;
 } km_stat_t;
 
+typedef struct {
+	long n_alloc, n_free, bytes; // bytes requested
+	size_t in_use, peak, capacity; // in_use and peak include block headers and padding
+} km_prof_stat_t;
+
+typedef struct {
+	void *chunk;
+	size_t off;
+} km_mark_t;
+
 void *kmalloc(void *km, size_t size);
 void *krealloc(void *km, void *ptr, size_t size);
 void *krelocate(void *km, void *ap, size_t n_bytes);
@@ -19,10 +29,53 @@ void kfree(void *km, void *ptr);
 
 void *km_init(void);
 void *km_init2(void *km_par, size_t min_core_size);
+
+#define KM_CORE_MMAP    0x1 // get cores from mmap() instead of the parent allocator
+#define KM_CORE_HUGETLB 0x2 // with KM_CORE_MMAP, try MAP_HUGETLB first, then fall back to KM_CORE_THP
+#define KM_CORE_THP     0x4 // with KM_CORE_MMAP, madvise(MADV_HUGEPAGE) on each core
+#define KM_CORE_RELEASE 0x8 // return a core as soon as it becomes completely free, except the last one
+
+/* km_init3() is similar to km_init2() except that _core_size_ is in bytes
+ * and the cores are managed according to _flags_. With hugepages, core sizes
+ * are rounded up to multiples of 2MB. */
+void *km_init3(void *km_par, size_t core_size, int flags);
+
+/* km_trim() returns completely free cores except the last one. For mmap'd
+ * cores, it also releases the pages in the middle of large free blocks with
+ * madvise(MADV_DONTNEED). */
+void km_trim(void *km);
+
+/* km_init_arena() creates a bump-pointer arena that takes chunks of at least
+ * _chunk_size_ bytes from _km_par_. It can be used in place of any other
+ * allocator. kfree() on an arena only reclaims the most recent allocation;
+ * memory is reclaimed in bulk with km_release_to_mark() or km_reset(). */
+void *km_init_arena(void *km_par, size_t chunk_size);
+km_mark_t km_mark(void *km); // the current position of an arena
+void km_release_to_mark(void *km, km_mark_t m); // free all allocations made after km_mark() returned _m_
+void km_reset(void *km); // free all allocations in an arena
+
+/* km_init_mt() creates a thread-safe allocator that can be passed to kmalloc()
+ * and other functions from any thread. Memory freed by any thread is reused.
+ * km_destroy() must not be called while other threads are using it.
+ * km_init_mt() returns NULL if no thread-specific key is available. */
+void *km_init_mt(void);
 void km_destroy(void *km);
 void km_stat(const void *_km, km_stat_t *s);
 void km_stat_print(const void *km);
 
+/* km_prof() turns allocation profiling of a basic allocator on or off. The
+ * profile is printed by km_stat_print(). km_tag() attributes subsequent
+ * allocations to _tag_, which must stay valid while profiling; KM_TAG() uses
+ * the file and line of the call site as the tag. */
+void km_prof(void *km, int on);
+void km_tag(void *km, const char *tag);
+
+/* km_prof_stat() gets the profile totals; km_prof_tag() gets the number and
+ * the requested bytes of allocations made under _tag_. Both return -1 if _km_
+ * is not being profiled or _tag_ has not been seen, or 0 otherwise. */
+int km_prof_stat(const void *km, km_prof_stat_t *s);
+int km_prof_tag(const void *km, const char *tag, long *n_alloc, long *bytes);
+
 #ifdef __cplusplus
 }
 #endif
@@ -30,6 +83,11 @@ void km_stat_print(const void *km);
 #define Kmalloc(km, type, cnt)       ((type*)kmalloc((km), (cnt) * sizeof(type)))
 #define Kcalloc(km, type, cnt)       ((type*)kcalloc((km), (cnt), sizeof(type)))
 #define Krealloc(km, type, ptr, cnt) ((type*)krealloc((km), (ptr), (cnt) * sizeof(type)))
+#define Kfree(km, ptr)               kfree((km), (ptr))
+
+#define KM_STR_(x) #x
+#define KM_STR(x)  KM_STR_(x)
+#define KM_TAG(km) km_tag((km), __FILE__ ":" KM_STR(__LINE__))
 
 #define Kexpand(km, type, a, m) do { \
 		(m) = (m) >= 4? (m) + ((m)>>1) : 16; \
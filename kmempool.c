@@ -1,20 +1,29 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "kmempool.h"
 
 #define Malloc(type, cnt)       ((type*)malloc((cnt) * sizeof(type)))
 #define Calloc(type, cnt)       ((type*)calloc((cnt), sizeof(type)))
 #define Realloc(type, ptr, cnt) ((type*)realloc((ptr), (cnt) * sizeof(type)))
 
+#define KMP_TYPE_BASIC 0
+#define KMP_TYPE_MT    1 // thread-safe pool; see below
+
+static void *kmpmt_alloc(void *mp_);
+static void kmpmt_free(void *mp_, void *p);
+static void kmpmt_destroy(void *mp_);
+static void kmpmt_trim(void *mp_);
+
 typedef struct {
+	uint32_t type; // KMP_TYPE_BASIC; all pool types start with this field
 	uint32_t sz; // size of an entry
 	uint32_t chunk_size; // number of entries in a chunk
 	uint32_t n_chunk; // number of chunks
 	uint8_t *p; // pointing to an entry that can be allocated from a chunk
 	uint8_t *p_end; // end of the current chunk
 	uint8_t **chunk; // list of chunks
-	uint32_t n_buf, m_buf; // number/max number of buffered free entries
-	void **buf; // list of pointers to free entries
+	void *free_list; // freed entries; each keeps the pointer to the next one
 } kmempool_t;
 
 static void kmp_add_chunk(kmempool_t *mp) // add a new chunk
@@ -29,7 +38,8 @@ void *kmp_init2(unsigned sz, unsigned chunk_size)
 {
 	kmempool_t *mp;
 	mp = Calloc(kmempool_t, 1);
-	mp->sz = sz, mp->chunk_size = chunk_size;
+	mp->sz = (sz + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*); // room and alignment for the free list link
+	mp->chunk_size = chunk_size;
 	kmp_add_chunk(mp);
 	return mp;
 }
@@ -43,17 +53,23 @@ void kmp_destroy(void *mp_)
 {
 	kmempool_t *mp = (kmempool_t*)mp_;
 	uint32_t i;
+	if (mp->type == KMP_TYPE_MT) {
+		kmpmt_destroy(mp);
+		return;
+	}
 	for (i = 0; i < mp->n_chunk; ++i) // free all chunks
 		free(mp->chunk[i]);
-	free(mp->chunk); free(mp->buf); free(mp);
+	free(mp->chunk); free(mp);
 }
 
 void *kmp_alloc(void *mp_)
 {
 	kmempool_t *mp = (kmempool_t*)mp_;
 	void *ret;
-	if (mp->n_buf > 0) { // there are buffered free entries
-		ret = mp->buf[--mp->n_buf];
+	if (mp->type == KMP_TYPE_MT) return kmpmt_alloc(mp);
+	if (mp->free_list) { // there are freed entries
+		ret = mp->free_list;
+		mp->free_list = *(void**)ret;
 	} else { // need to "allocate" from chunks
 		if (mp->p == mp->p_end) kmp_add_chunk(mp); // chunk full; add a new one
 		ret = (void*)mp->p;
@@ -65,9 +81,267 @@ void *kmp_alloc(void *mp_)
 void kmp_free(void *mp_, void *p)
 {
 	kmempool_t *mp = (kmempool_t*)mp_;
-	if (mp->n_buf == mp->m_buf) { // then enlarge the buffer
-		mp->m_buf += (mp->m_buf>>1) + 16;
-		mp->buf = Realloc(void*, mp->buf, mp->m_buf);
+	if (mp->type == KMP_TYPE_MT) {
+		kmpmt_free(mp, p);
+		return;
+	}
+	*(void**)p = mp->free_list;
+	mp->free_list = p;
+}
+
+static int kmp_chunk_cmp(const void *a, const void *b)
+{
+	const uint8_t *x = *(uint8_t *const*)a, *y = *(uint8_t *const*)b;
+	return x < y? -1 : x > y? 1 : 0;
+}
+
+static int64_t kmp_chunk_find(uint8_t **chunk, uint32_t n, uint64_t size, const uint8_t *p) // find the chunk containing _p_ in a sorted array
+{
+	uint32_t lo = 0, hi = n;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (p < chunk[mid]) hi = mid;
+		else if (p >= chunk[mid] + size) lo = mid + 1;
+		else return mid;
+	}
+	return -1;
+}
+
+void kmp_trim(void *mp_)
+{
+	kmempool_t *mp = (kmempool_t*)mp_;
+	uint64_t size = (uint64_t)mp->sz * mp->chunk_size;
+	uint32_t i, j, *cnt;
+	void *p, **q;
+	if (mp->type == KMP_TYPE_MT) {
+		kmpmt_trim(mp);
+		return;
+	}
+	if (mp->free_list == 0) return;
+	qsort(mp->chunk, mp->n_chunk, sizeof(uint8_t*), kmp_chunk_cmp);
+	cnt = Calloc(uint32_t, mp->n_chunk);
+	for (p = mp->free_list; p; p = *(void**)p) // count free entries in each chunk
+		++cnt[kmp_chunk_find(mp->chunk, mp->n_chunk, size, (uint8_t*)p)];
+	for (i = 0; i < mp->n_chunk; ++i) { // mark completely free chunks with cnt[i]=0
+		uint32_t n_carved = mp->p_end == mp->chunk[i] + size? (mp->p - mp->chunk[i]) / mp->sz : mp->chunk_size;
+		cnt[i] = cnt[i] == n_carved? 0 : 1;
+	}
+	for (q = &mp->free_list; *q;) { // drop entries in free chunks from the free list
+		int64_t k = kmp_chunk_find(mp->chunk, mp->n_chunk, size, (uint8_t*)*q);
+		if (cnt[k] == 0) *q = **(void***)q;
+		else q = (void**)*q;
+	}
+	for (i = j = 0; i < mp->n_chunk; ++i) {
+		if (cnt[i] == 0) {
+			if (mp->p_end == mp->chunk[i] + size) mp->p = mp->p_end = 0; // the current chunk
+			free(mp->chunk[i]);
+		} else mp->chunk[j++] = mp->chunk[i];
+	}
+	mp->n_chunk = j;
+	free(cnt);
+}
+
+/*************************
+ * Thread-safe mempool *
+ *************************/
+
+/* Each thread caches free entries in two magazines, fixed-size stacks of
+ * pointers. kmp_alloc() and kmp_free() only touch the calling thread's
+ * magazines until both are empty or full, respectively. Then a magazine is
+ * exchanged with the depot, which keeps one lock-free stack of non-empty
+ * magazines and one of empty magazines. A magazine is identified by a 32-bit
+ * index, such that a stack head packs the index with a modification counter
+ * into one 64-bit word and the stacks are immune to the ABA problem.
+ * Magazines are never freed before kmp_destroy(). The lock is only taken to
+ * carve new entries from chunks, to create magazines and when a thread starts
+ * or exits. */
+
+#define KMP_MAG_SIZE   64
+#define KMP_SLAB_BITS  6 // slab s keeps 1<<(KMP_SLAB_BITS+s) magazines
+#define KMP_N_SLAB     26
+
+typedef struct {
+	uint32_t id; // index of the magazine
+	uint32_t next; // index+1 of the next magazine in a depot stack
+	uint32_t n; // number of entries
+	void *e[KMP_MAG_SIZE];
+} kmp_mag_t;
+
+typedef struct kmp_tcache_t {
+	struct kmp_tcache_t *next, *prev; // in the list of all thread caches
+	void *mt; // the pool
+	kmp_mag_t *loaded, *last;
+} kmp_tcache_t;
+
+typedef struct {
+	uint32_t type; // KMP_TYPE_MT
+	uint32_t sz;
+	uint64_t full, empty; // depot stack heads: counter<<32 | (index+1); 0 for empty stacks
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	kmempool_t *mp; // where new entries are carved from; protected by lock
+	uint32_t n_mag; // number of magazines; protected by lock
+	kmp_tcache_t *tc; // all thread caches; protected by lock
+	kmp_mag_t *slab[KMP_N_SLAB];
+} kmpmt_t;
+
+static inline kmp_mag_t *kmpmt_mag(kmpmt_t *mt, uint32_t i)
+{
+	int s = 31 - __builtin_clz((i >> KMP_SLAB_BITS) + 1);
+	return &mt->slab[s][i - ((((uint32_t)1 << s) - 1) << KMP_SLAB_BITS)];
+}
+
+static void kmpmt_push(uint64_t *head, kmp_mag_t *m)
+{
+	uint64_t h, x;
+	h = __atomic_load_n(head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&m->next, (uint32_t)h, __ATOMIC_RELAXED);
+		x = ((h>>32) + 1) << 32 | (m->id + 1);
+	} while (!__atomic_compare_exchange_n(head, &h, x, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static kmp_mag_t *kmpmt_pop(kmpmt_t *mt, uint64_t *head)
+{
+	uint64_t h, x;
+	kmp_mag_t *m;
+	h = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+	do {
+		if ((uint32_t)h == 0) return 0;
+		m = kmpmt_mag(mt, (uint32_t)h - 1);
+		x = ((h>>32) + 1) << 32 | __atomic_load_n(&m->next, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(head, &h, x, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return m;
+}
+
+static kmp_mag_t *kmpmt_new_mag(kmpmt_t *mt, int fill) // get a magazine from the pool; fill it with new entries if _fill_ is true
+{
+	kmp_mag_t *m;
+	pthread_mutex_lock(&mt->lock);
+	if ((mt->n_mag>>KMP_SLAB_BITS) + 1 == 1U<<KMP_N_SLAB) abort(); // too many magazines
+	if (((mt->n_mag>>KMP_SLAB_BITS) & ((mt->n_mag>>KMP_SLAB_BITS) + 1)) == 0 && (mt->n_mag & ((1<<KMP_SLAB_BITS)-1)) == 0) { // the first magazine in a new slab
+		int s = 31 - __builtin_clz((mt->n_mag >> KMP_SLAB_BITS) + 1);
+		mt->slab[s] = Calloc(kmp_mag_t, 1U << (KMP_SLAB_BITS + s));
+	}
+	m = kmpmt_mag(mt, mt->n_mag);
+	m->id = mt->n_mag++;
+	if (fill)
+		for (m->n = 0; m->n < KMP_MAG_SIZE; ++m->n)
+			m->e[m->n] = kmp_alloc(mt->mp);
+	pthread_mutex_unlock(&mt->lock);
+	return m;
+}
+
+static void kmpmt_put(kmpmt_t *mt, kmp_mag_t *m) // return a magazine to the depot
+{
+	kmpmt_push(m->n? &mt->full : &mt->empty, m);
+}
+
+static void kmpmt_thread_exit(void *tc_)
+{
+	kmp_tcache_t *tc = (kmp_tcache_t*)tc_;
+	kmpmt_t *mt = (kmpmt_t*)tc->mt;
+	kmpmt_put(mt, tc->loaded);
+	kmpmt_put(mt, tc->last);
+	pthread_mutex_lock(&mt->lock);
+	if (tc->prev) tc->prev->next = tc->next;
+	else mt->tc = tc->next;
+	if (tc->next) tc->next->prev = tc->prev;
+	pthread_mutex_unlock(&mt->lock);
+	free(tc);
+}
+
+static kmp_tcache_t *kmpmt_tcache(kmpmt_t *mt) // get the cache of the calling thread
+{
+	kmp_tcache_t *tc;
+	if ((tc = (kmp_tcache_t*)pthread_getspecific(mt->key)) != 0) return tc;
+	tc = Calloc(kmp_tcache_t, 1);
+	tc->mt = mt;
+	if ((tc->loaded = kmpmt_pop(mt, &mt->empty)) == 0) tc->loaded = kmpmt_new_mag(mt, 0);
+	if ((tc->last = kmpmt_pop(mt, &mt->empty)) == 0) tc->last = kmpmt_new_mag(mt, 0);
+	pthread_mutex_lock(&mt->lock);
+	tc->next = mt->tc;
+	if (mt->tc) mt->tc->prev = tc;
+	mt->tc = tc;
+	pthread_mutex_unlock(&mt->lock);
+	pthread_setspecific(mt->key, tc);
+	return tc;
+}
+
+void *kmp_init_mt(unsigned sz)
+{
+	kmpmt_t *mt;
+	mt = Calloc(kmpmt_t, 1);
+	if (mt == 0) return 0;
+	if (pthread_key_create(&mt->key, kmpmt_thread_exit) != 0) { // out of keys
+		free(mt);
+		return 0;
+	}
+	mt->type = KMP_TYPE_MT;
+	mt->sz = sz;
+	mt->mp = (kmempool_t*)kmp_init(sz);
+	pthread_mutex_init(&mt->lock, 0);
+	return mt;
+}
+
+static void kmpmt_destroy(void *mp_)
+{
+	kmpmt_t *mt = (kmpmt_t*)mp_;
+	kmp_tcache_t *tc, *next;
+	uint32_t s;
+	pthread_key_delete(mt->key);
+	for (tc = mt->tc; tc; tc = next) // caches of threads that are still alive
+		next = tc->next, free(tc);
+	for (s = 0; s < KMP_N_SLAB && mt->slab[s]; ++s)
+		free(mt->slab[s]);
+	kmp_destroy(mt->mp);
+	pthread_mutex_destroy(&mt->lock);
+	free(mt);
+}
+
+static void *kmpmt_alloc(void *mp_)
+{
+	kmpmt_t *mt = (kmpmt_t*)mp_;
+	kmp_tcache_t *tc = kmpmt_tcache(mt);
+	if (tc->loaded->n == 0) {
+		kmp_mag_t *m;
+		if (tc->last->n > 0) { // swap the two magazines
+			m = tc->loaded, tc->loaded = tc->last, tc->last = m;
+		} else { // both empty; exchange one with the depot
+			if ((m = kmpmt_pop(mt, &mt->full)) == 0) m = kmpmt_new_mag(mt, 1);
+			kmpmt_put(mt, tc->last);
+			tc->last = tc->loaded, tc->loaded = m;
+		}
+	}
+	return tc->loaded->e[--tc->loaded->n];
+}
+
+static void kmpmt_free(void *mp_, void *p)
+{
+	kmpmt_t *mt = (kmpmt_t*)mp_;
+	kmp_tcache_t *tc = kmpmt_tcache(mt);
+	if (tc->loaded->n == KMP_MAG_SIZE) {
+		kmp_mag_t *m;
+		if (tc->last->n < KMP_MAG_SIZE) { // swap the two magazines
+			m = tc->loaded, tc->loaded = tc->last, tc->last = m;
+		} else { // both full; exchange one with the depot
+			if ((m = kmpmt_pop(mt, &mt->empty)) == 0) m = kmpmt_new_mag(mt, 0);
+			kmpmt_put(mt, tc->last);
+			tc->last = tc->loaded, tc->loaded = m;
+		}
+	}
+	tc->loaded->e[tc->loaded->n++] = p;
+}
+
+static void kmpmt_trim(void *mp_) // return entries in the depot to the backing pool and trim it
+{
+	kmpmt_t *mt = (kmpmt_t*)mp_;
+	kmp_mag_t *m;
+	pthread_mutex_lock(&mt->lock);
+	while ((m = kmpmt_pop(mt, &mt->full)) != 0) {
+		while (m->n > 0) kmp_free(mt->mp, m->e[--m->n]);
+		kmpmt_push(&mt->empty, m);
 	}
-	mp->buf[mp->n_buf++] = p;
+	kmp_trim(mt->mp);
+	pthread_mutex_unlock(&mt->lock);
 }
@@ -6,10 +6,22 @@ extern "C" {
 #endif
 
 void *kmp_init(unsigned sz);
+void *kmp_init2(unsigned sz, unsigned chunk_size);
+
+/* kmp_init_mt() creates a pool that can be used from multiple threads at the
+ * same time. An entry may be freed by a thread other than the one that
+ * allocated it. The pool must not be used after kmp_destroy().
+ * kmp_init_mt() returns NULL if no thread-specific key is available. */
+void *kmp_init_mt(unsigned sz);
+
 void kmp_destroy(void *mp);
 void *kmp_alloc(void *mp);
 void kmp_free(void *mp, void *p);
 
+/* kmp_trim() releases chunks in which all entries have been freed. For a pool
+ * created by kmp_init_mt(), entries cached by threads are not released. */
+void kmp_trim(void *mp);
+
 #ifdef __cplusplus
 }
 #endif
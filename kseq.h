@@ -32,16 +32,27 @@
 #include <string.h>
 #include <stdlib.h>
 
+#ifndef klib_unused
+#if (defined __clang__ && __clang_major__ >= 3) || (defined __GNUC__ && __GNUC__ >= 3)
+#define klib_unused __attribute__ ((__unused__))
+#else
+#define klib_unused
+#endif
+#endif /* klib_unused */
+
 #define KS_SEP_SPACE 0 // isspace(): \t, \n, \v, \f, \r
 #define KS_SEP_TAB   1 // isspace() && !' '
 #define KS_SEP_LINE  2 // line separator: "\n" (Unix) or "\r\n" (Windows)
 #define KS_SEP_MAX   2
 
+struct ks_ra_t;
+
 #define __KS_TYPE(type_t)						\
 	typedef struct __kstream_t {				\
 		unsigned char *buf;						\
 		int begin, end, is_eof;					\
 		type_t f;								\
+		struct ks_ra_t *ra; /* readahead; see KSTREAM_INIT_RA */ \
 	} kstream_t;
 
 #define ks_err(ks) ((ks)->end == -1)
@@ -64,6 +75,10 @@
 		}															\
 	}
 
+#define __KS_FILL(__read, __bufsize)					\
+	static inline int ks_fill(kstream_t *ks)			\
+	{ return __read(ks->f, ks->buf, __bufsize); }
+
 #define __KS_GETC(__read, __bufsize)						\
 	static inline int ks_getc(kstream_t *ks)				\
 	{														\
@@ -71,7 +86,7 @@
 		if (ks->is_eof && ks->begin >= ks->end) return -1;	\
 		if (ks->begin >= ks->end) {							\
 			ks->begin = 0;									\
-			ks->end = __read(ks->f, ks->buf, __bufsize);	\
+			ks->end = ks_fill(ks);	\
 			if (ks->end == 0) { ks->is_eof = 1; return -1;}	\
 			if (ks->end == -1) { ks->is_eof = 1; return -3;}\
 		}													\
@@ -102,7 +117,7 @@ typedef struct __kstring_t {
 			if (ks->begin >= ks->end) {									\
 				if (!ks->is_eof) {										\
 					ks->begin = 0;										\
-					ks->end = __read(ks->f, ks->buf, __bufsize);		\
+					ks->end = ks_fill(ks);		\
 					if (ks->end == 0) { ks->is_eof = 1; break; }		\
 					if (ks->end == -1) { ks->is_eof = 1; return -3; }	\
 				} else break;											\
@@ -138,18 +153,202 @@ typedef struct __kstring_t {
 		if (str->s == 0) {												\
 			str->m = 1;													\
 			str->s = (char*)calloc(1, 1);								\
-		} else if (delimiter == KS_SEP_LINE && str->l > 1 && str->s[str->l-1] == '\r') --str->l; \
+		} else if (delimiter == KS_SEP_LINE && str->l > 0 && str->s[str->l-1] == '\r') --str->l; \
 		str->s[str->l] = '\0';											\
 		return str->l;													\
 	} \
 	static inline int ks_getuntil(kstream_t *ks, int delimiter, kstring_t *str, int *dret) \
 	{ return ks_getuntil2(ks, delimiter, str, dret, 0); }
 
+/* Append lines to _str_ without line endings, until a line starting with '>',
+ * '+' or '@'. Return that character, which is consumed, -1 at the end of the
+ * file or -3 on a read error. Empty lines are skipped. _str_ is grown once per
+ * buffer, such that lines are copied without per-line function calls and
+ * capacity checks. If _pk_ is not NULL, the lines are packed into _pk_ with
+ * kseq_pack_append() instead, and _str_ is left untouched. */
+#define __KS_GETSEQ(__read, __bufsize)									\
+	static inline int ks_getseq2(kstream_t *ks, kstring_t *str, kseq_pack_t *pk) \
+	{																	\
+		int at_bol = 1, cr = 0; /* cr: a '\r' ending the last buffer is not packed yet */ \
+		for (;;) {														\
+			unsigned char *p, *q, *end;									\
+			if (ks_err(ks)) return -3;									\
+			if (ks->begin >= ks->end) {									\
+				if (ks->is_eof) return -1;								\
+				ks->begin = 0;											\
+				ks->end = ks_fill(ks);			\
+				if (ks->end == 0) { ks->is_eof = 1; return -1; }		\
+				if (ks->end == -1) { ks->is_eof = 1; return -3; }		\
+			}															\
+			if (pk == 0 && str->m - str->l < (size_t)(ks->end - ks->begin) + 1) {	\
+				str->m = str->l + (ks->end - ks->begin) + 1;			\
+				kroundup32(str->m);										\
+				str->s = (char*)realloc(str->s, str->m);				\
+			}															\
+			p = ks->buf + ks->begin, end = ks->buf + ks->end;			\
+			while (p < end) {											\
+				if (at_bol) {											\
+					if (*p == '>' || *p == '+' || *p == '@') {			\
+						ks->begin = p + 1 - ks->buf;					\
+						return *p;										\
+					}													\
+					if (*p == '\n') { ++p; continue; }					\
+				}														\
+				if ((q = (unsigned char*)memchr(p, '\n', end - p)) == 0) { /* the line continues in the next buffer */ \
+					if (pk) {											\
+						if (cr) kseq_pack_append(pk, "\r", 1);			\
+						cr = (end[-1] == '\r');							\
+						kseq_pack_append(pk, (const char*)p, end - p - cr); \
+					} else {											\
+						memcpy(str->s + str->l, p, end - p);			\
+						str->l += end - p;								\
+					}													\
+					at_bol = 0;											\
+					break;												\
+				}														\
+				if (pk) {												\
+					if (cr && q > p) kseq_pack_append(pk, "\r", 1);	\
+					kseq_pack_append(pk, (const char*)p, q - p - (q > p && q[-1] == '\r')); \
+					cr = 0;												\
+				} else {												\
+					memcpy(str->s + str->l, p, q - p);					\
+					str->l += q - p;									\
+					if (str->l > 0 && str->s[str->l-1] == '\r') --str->l; \
+				}														\
+				p = q + 1, at_bol = 1;									\
+			}															\
+			ks->begin = ks->end;										\
+		}																\
+	}																	\
+	static inline int ks_getseq(kstream_t *ks, kstring_t *str)			\
+	{ return ks_getseq2(ks, str, 0); }
+
 #define KSTREAM_INIT(type_t, __read, __bufsize) \
 	__KS_TYPE(type_t)							\
 	__KS_BASIC(type_t, __bufsize)				\
+	__KS_FILL(__read, __bufsize)				\
+	__KS_GETC(__read, __bufsize)				\
+	__KS_GETUNTIL(__read, __bufsize)			\
+	__KS_GETSEQ(__read, __bufsize)
+
+/*************
+ * Readahead *
+ *************/
+
+/* With KSTREAM_INIT_RA(), a background thread calls __read() to fill a ring
+ * of KS_RA_N_BUF buffers while the parser consumes the previous one, such
+ * that decompression and parsing run on two cores. ks->buf points to the
+ * buffer being parsed; it is handed back to the reader on the next refill.
+ * The stream must be destroyed before the file is closed, and it cannot be
+ * rewound. Readahead requires pthreads; define KSEQ_RA before including
+ * kseq.h to enable KSTREAM_INIT_RA() and KSEQ_INIT_RA(). */
+
+#ifdef KSEQ_RA
+#include <pthread.h>
+
+#define KS_RA_N_BUF 3
+
+typedef struct ks_ra_t {
+	int n_full, rd, wr, held, stop;
+	int len[KS_RA_N_BUF];
+	unsigned char *buf[KS_RA_N_BUF];
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_full, cv_empty;
+} ks_ra_t;
+
+static inline ks_ra_t *ks_ra_init(int bufsize)
+{
+	int i;
+	ks_ra_t *ra = (ks_ra_t*)calloc(1, sizeof(ks_ra_t));
+	for (i = 0; i < KS_RA_N_BUF; ++i)
+		ra->buf[i] = (unsigned char*)malloc(bufsize);
+	pthread_mutex_init(&ra->lock, 0);
+	pthread_cond_init(&ra->cv_full, 0);
+	pthread_cond_init(&ra->cv_empty, 0);
+	return ra;
+}
+
+static inline void ks_ra_destroy(ks_ra_t *ra)
+{
+	int i;
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = 1;
+	pthread_cond_signal(&ra->cv_empty);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_join(ra->tid, 0);
+	for (i = 0; i < KS_RA_N_BUF; ++i) free(ra->buf[i]);
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->cv_full);
+	pthread_cond_destroy(&ra->cv_empty);
+	free(ra);
+}
+
+static inline int ks_ra_next(ks_ra_t *ra, unsigned char **buf) // return the buffer being parsed and get the next one
+{
+	int l;
+	pthread_mutex_lock(&ra->lock);
+	if (ra->held) {
+		if (ra->len[ra->rd] <= 0) { // the reader has stopped at EOF or an error
+			pthread_mutex_unlock(&ra->lock);
+			return ra->len[ra->rd];
+		}
+		ra->rd = (ra->rd + 1) % KS_RA_N_BUF, --ra->n_full;
+		pthread_cond_signal(&ra->cv_empty);
+	}
+	while (ra->n_full == 0) pthread_cond_wait(&ra->cv_full, &ra->lock);
+	*buf = ra->buf[ra->rd], l = ra->len[ra->rd], ra->held = 1;
+	pthread_mutex_unlock(&ra->lock);
+	return l;
+}
+
+#define __KS_BASIC_RA(type_t, __read, __bufsize)					\
+	static void *ks_ra_worker(void *data)							\
+	{																\
+		kstream_t *ks = (kstream_t*)data;							\
+		ks_ra_t *ra = ks->ra;										\
+		for (;;) {													\
+			int i, l;												\
+			pthread_mutex_lock(&ra->lock);							\
+			while (ra->n_full == KS_RA_N_BUF && !ra->stop)			\
+				pthread_cond_wait(&ra->cv_empty, &ra->lock);		\
+			i = ra->wr;												\
+			if (ra->stop) { pthread_mutex_unlock(&ra->lock); break; } \
+			pthread_mutex_unlock(&ra->lock);						\
+			l = __read(ks->f, ra->buf[i], __bufsize);				\
+			pthread_mutex_lock(&ra->lock);							\
+			ra->len[i] = l, ra->wr = (i + 1) % KS_RA_N_BUF, ++ra->n_full; \
+			pthread_cond_signal(&ra->cv_full);						\
+			pthread_mutex_unlock(&ra->lock);						\
+			if (l <= 0) break;										\
+		}															\
+		return 0;													\
+	}																\
+	static inline kstream_t *ks_init(type_t f)						\
+	{																\
+		kstream_t *ks = (kstream_t*)calloc(1, sizeof(kstream_t));	\
+		ks->f = f;													\
+		ks->ra = ks_ra_init(__bufsize);								\
+		pthread_create(&ks->ra->tid, 0, ks_ra_worker, ks);			\
+		return ks;													\
+	}																\
+	static inline void ks_destroy(kstream_t *ks)					\
+	{																\
+		if (ks) {													\
+			ks_ra_destroy(ks->ra);									\
+			free(ks);												\
+		}															\
+	}																\
+	static inline int ks_fill(kstream_t *ks)						\
+	{ return ks_ra_next(ks->ra, &ks->buf); }
+
+#define KSTREAM_INIT_RA(type_t, __read, __bufsize) \
+	__KS_TYPE(type_t)							\
+	__KS_BASIC_RA(type_t, __read, __bufsize)	\
 	__KS_GETC(__read, __bufsize)				\
-	__KS_GETUNTIL(__read, __bufsize)
+	__KS_GETUNTIL(__read, __bufsize)			\
+	__KS_GETSEQ(__read, __bufsize)
+#endif /* KSEQ_RA */
 
 #define kseq_rewind(ks) ((ks)->last_char = (ks)->f->is_eof = (ks)->f->begin = (ks)->f->end = 0)
 
@@ -164,6 +363,7 @@ typedef struct __kstring_t {
 	{																	\
 		if (!ks) return;												\
 		free(ks->name.s); free(ks->comment.s); free(ks->seq.s);	free(ks->qual.s); \
+		kseq_pack_destroy(&ks->pack);									\
 		ks_destroy(ks->f);												\
 		free(ks);														\
 	}
@@ -173,11 +373,14 @@ typedef struct __kstring_t {
    -1   end-of-file
    -2   truncated quality string
    -3   error reading stream
+   If seq->pack.bits is set to 2 or 4, the sequence is packed into seq->pack
+   as it is parsed, and seq->seq is left empty; see kseq_pack().
  */
 #define __KSEQ_READ(SCOPE) \
 	SCOPE int kseq_read(kseq_t *seq) \
 	{ \
 		int c,r; \
+		size_t l_seq; \
 		kstream_t *ks = seq->f; \
 		if (seq->last_char == 0) { /* then jump to the next header line */ \
 			while ((c = ks_getc(ks)) >= 0 && c != '>' && c != '@'); \
@@ -191,11 +394,8 @@ typedef struct __kstring_t {
 			seq->seq.m = 256; \
 			seq->seq.s = (char*)malloc(seq->seq.m); \
 		} \
-		while ((c = ks_getc(ks)) >= 0 && c != '>' && c != '+' && c != '@') { \
-			if (c == '\n') continue; /* skip empty lines */ \
-			seq->seq.s[seq->seq.l++] = c; /* this is safe: we always have enough space for 1 char */ \
-			ks_getuntil2(ks, KS_SEP_LINE, &seq->seq, 0, 1); /* read the rest of the line */ \
-		} \
+		if (seq->pack.bits) seq->pack.l = seq->pack.n_run = 0; \
+		c = ks_getseq2(ks, &seq->seq, seq->pack.bits? &seq->pack : 0); /* read sequence lines up to the next '>', '+' or '@' line */ \
 		if (c == '>' || c == '@') seq->last_char = c; /* the first header char has been read */	\
 		if (seq->seq.l + 1 >= seq->seq.m) { /* seq->seq.s[seq->seq.l] below may be out of boundary */ \
 			seq->seq.m = seq->seq.l + 2; \
@@ -203,24 +403,131 @@ typedef struct __kstring_t {
 			seq->seq.s = (char*)realloc(seq->seq.s, seq->seq.m); \
 		} \
 		seq->seq.s[seq->seq.l] = 0;	/* null terminated string */ \
-		if (c != '+') return seq->seq.l; /* FASTA */ \
+		l_seq = seq->pack.bits? seq->pack.l : seq->seq.l; \
+		if (c != '+') return l_seq; /* FASTA */ \
 		if (seq->qual.m < seq->seq.m) {	/* allocate memory for qual in case insufficient */ \
 			seq->qual.m = seq->seq.m; \
 			seq->qual.s = (char*)realloc(seq->qual.s, seq->qual.m); \
 		} \
 		while ((c = ks_getc(ks)) >= 0 && c != '\n'); /* skip the rest of '+' line */ \
 		if (c == -1) return -2; /* error: no quality string */ \
-		while ((c = ks_getuntil2(ks, KS_SEP_LINE, &seq->qual, 0, 1) >= 0 && seq->qual.l < seq->seq.l)); \
+		while ((c = ks_getuntil2(ks, KS_SEP_LINE, &seq->qual, 0, 1) >= 0 && seq->qual.l < l_seq)); \
 		if (c == -3) return -3; /* stream error */ \
 		seq->last_char = 0;	/* we have not come to the next header line */ \
-		if (seq->seq.l != seq->qual.l) return -2; /* error: qual string is of a different length */ \
-		return seq->seq.l; \
+		if (l_seq != seq->qual.l) return -2; /* error: qual string is of a different length */ \
+		return l_seq; \
+	}
+
+/* kseq_read_batch() packs records into one buffer: name, comment, seq and
+ * qual of each record are stored back to back, each null terminated. Fields
+ * are addressed by offsets, such that the buffer can grow while reading and
+ * the batch can be handed to another thread as a whole. The buffer and the
+ * offset table are reused when the batch is read into again. */
+typedef struct {
+	size_t name, comment, seq, qual; // offsets into kseq_batch_t::buf
+	int l_name, l_comment, l_seq, l_qual;
+} kseq_rec_t;
+
+typedef struct {
+	int n, m; // number of records and the capacity of rec
+	size_t l, m_buf; // bytes used and the capacity of buf
+	char *buf;
+	kseq_rec_t *rec;
+} kseq_batch_t;
+
+#define kseq_batch_name(b, i)    ((b)->buf + (b)->rec[(i)].name)
+#define kseq_batch_comment(b, i) ((b)->buf + (b)->rec[(i)].comment)
+#define kseq_batch_seq(b, i)     ((b)->buf + (b)->rec[(i)].seq)
+#define kseq_batch_qual(b, i)    ((b)->buf + (b)->rec[(i)].qual)
+
+static inline void kseq_batch_destroy(kseq_batch_t *b)
+{
+	if (!b) return;
+	free(b->buf); free(b->rec);
+	b->buf = 0, b->rec = 0, b->n = b->m = 0, b->l = b->m_buf = 0;
+}
+
+static inline size_t kseq_batch_push(kseq_batch_t *b, const kstring_t *s)
+{
+	size_t off = b->l;
+	if (b->l + s->l + 1 > b->m_buf) {
+		b->m_buf = b->l + s->l + 1;
+		b->m_buf += b->m_buf >> 1;
+		b->buf = (char*)realloc(b->buf, b->m_buf);
+	}
+	if (s->l) memcpy(b->buf + b->l, s->s, s->l);
+	b->buf[b->l + s->l] = 0;
+	b->l += s->l + 1;
+	return off;
+}
+
+/* Test if two read names belong to a pair, ignoring "/1" and "/2" suffixes */
+static inline int kseq_name_paired(const char *a, int la, const char *b, int lb)
+{
+	if (la >= 2 && a[la-2] == '/' && (a[la-1] == '1' || a[la-1] == '2')) la -= 2;
+	if (lb >= 2 && b[lb-2] == '/' && (b[lb-1] == '1' || b[lb-1] == '2')) lb -= 2;
+	return la == lb && memcmp(a, b, la) == 0;
+}
+
+/* Return value of kseq_read_batch():
+   >0   number of records read into _b_; reading stops after _max_records_
+        records or once _max_bytes_ bytes have been packed
+    0   end-of-file
+   -2   truncated quality string
+   -3   error reading stream
+   On an error, _b_ keeps the records read before it.
+
+   kseq_read_pair() reads R1 and R2 records from two streams in lockstep and
+   stores them interleaved: b->rec[2*i] and b->rec[2*i+1] form the i-th pair.
+   It returns the number of pairs, or the same error codes plus:
+   -4   read names do not match or one file ends before the other
+   With KSEQ_INIT_RA(), both files are decompressed in background threads.
+ */
+#define __KSEQ_BATCH(SCOPE) \
+	static inline void kseq_batch_add(kseq_batch_t *b, const kseq_t *seq) \
+	{ \
+		kseq_rec_t *p; \
+		if (b->n == b->m) { \
+			b->m = b->m? b->m + (b->m>>1) : 256; \
+			b->rec = (kseq_rec_t*)realloc(b->rec, b->m * sizeof(kseq_rec_t)); \
+		} \
+		p = &b->rec[b->n++]; \
+		p->name = kseq_batch_push(b, &seq->name), p->l_name = seq->name.l; \
+		p->comment = kseq_batch_push(b, &seq->comment), p->l_comment = seq->comment.l; \
+		p->seq = kseq_batch_push(b, &seq->seq), p->l_seq = seq->seq.l; \
+		p->qual = kseq_batch_push(b, &seq->qual), p->l_qual = seq->qual.l; \
+	} \
+	SCOPE klib_unused int kseq_read_batch(kseq_t *seq, int max_records, size_t max_bytes, kseq_batch_t *b) \
+	{ \
+		int r = 0; \
+		b->n = 0, b->l = 0; \
+		while (b->n < max_records && b->l < max_bytes) { \
+			if ((r = kseq_read(seq)) < 0) break; \
+			kseq_batch_add(b, seq); \
+		} \
+		return r < -1? r : b->n; \
+	} \
+	SCOPE klib_unused int kseq_read_pair(kseq_t *s1, kseq_t *s2, int max_pairs, size_t max_bytes, kseq_batch_t *b) \
+	{ \
+		int r1 = 0, r2 = 0; \
+		b->n = 0, b->l = 0; \
+		while (b->n < max_pairs * 2 && b->l < max_bytes) { \
+			r1 = kseq_read(s1), r2 = kseq_read(s2); \
+			if (r1 < -1 || r2 < -1) return r1 < -1? r1 : r2; \
+			if (r1 == -1 && r2 == -1) break; \
+			if (r1 == -1 || r2 == -1) return -4; /* one file ends early */ \
+			if (!kseq_name_paired(s1->name.s, s1->name.l, s2->name.s, s2->name.l)) return -4; \
+			kseq_batch_add(b, s1); \
+			kseq_batch_add(b, s2); \
+		} \
+		return b->n / 2; \
 	}
 
 #define __KSEQ_TYPE(type_t)						\
 	typedef struct {							\
 		kstring_t name, comment, seq, qual;		\
 		int last_char;							\
+		kseq_pack_t pack; /* used instead of seq if pack.bits is set */ \
 		kstream_t *f;							\
 	} kseq_t;
 
@@ -228,15 +535,326 @@ typedef struct __kstring_t {
 	KSTREAM_INIT(type_t, __read, 16384)			\
 	__KSEQ_TYPE(type_t)							\
 	__KSEQ_BASIC(SCOPE, type_t)					\
-	__KSEQ_READ(SCOPE)
+	__KSEQ_READ(SCOPE)							\
+	__KSEQ_BATCH(SCOPE)
 
 #define KSEQ_INIT(type_t, __read) KSEQ_INIT2(static, type_t, __read)
 
+#ifdef KSEQ_RA
+#define KSEQ_INIT2_RA(SCOPE, type_t, __read)	\
+	KSTREAM_INIT_RA(type_t, __read, 0x40000)	\
+	__KSEQ_TYPE(type_t)							\
+	__KSEQ_BASIC(SCOPE, type_t)					\
+	__KSEQ_READ(SCOPE)							\
+	__KSEQ_BATCH(SCOPE)
+
+#define KSEQ_INIT_RA(type_t, __read) KSEQ_INIT2_RA(static, type_t, __read)
+#endif
+
 #define KSEQ_DECLARE(type_t) \
 	__KS_TYPE(type_t) \
 	__KSEQ_TYPE(type_t) \
 	extern kseq_t *kseq_init(type_t fd); \
 	void kseq_destroy(kseq_t *ks); \
-	int kseq_read(kseq_t *seq);
+	int kseq_read(kseq_t *seq); \
+	int kseq_read_batch(kseq_t *seq, int max_records, size_t max_bytes, kseq_batch_t *b); \
+	int kseq_read_pair(kseq_t *s1, kseq_t *s2, int max_pairs, size_t max_bytes, kseq_batch_t *b);
+
+/*********************************
+ * Zero-copy parsing from memory *
+ *********************************/
+
+/* kseq_mem_read() parses FASTA/FASTQ in a buffer that holds the whole input,
+ * such as an mmap'd uncompressed file. Fields are views into the buffer and
+ * are NOT null terminated. Only a sequence or quality string that spans
+ * multiple lines is copied into a buffer owned by kseq_mem_t, which is valid
+ * until the next call. The return values are the same as kseq_read(). */
+
+typedef struct {
+	size_t l;
+	const char *s;
+} kseq_view_t;
+
+typedef struct {
+	kseq_view_t name, comment, seq, qual;
+	int last_char;
+	const char *p, *end; // the current position and the end of the input
+	kstring_t tmp[2]; // for multi-line sequence and quality
+} kseq_mem_t;
+
+static inline kseq_mem_t *kseq_mem_init(const void *buf, size_t len)
+{
+	kseq_mem_t *m = (kseq_mem_t*)calloc(1, sizeof(kseq_mem_t));
+	m->p = (const char*)buf, m->end = m->p + len;
+	return m;
+}
+
+static inline void kseq_mem_destroy(kseq_mem_t *m)
+{
+	if (!m) return;
+	free(m->tmp[0].s); free(m->tmp[1].s);
+	free(m);
+}
+
+static inline void kseq_mem_append(kstring_t *t, const char *s, size_t l)
+{
+	if (t->m < t->l + l + 1) {
+		t->m = t->l + l + 1;
+		kroundup32(t->m);
+		t->s = (char*)realloc(t->s, t->m);
+	}
+	memcpy(t->s + t->l, s, l);
+	t->l += l;
+}
+
+/* Read a line starting at m->p into _v_; append it to _t_ if _v_ already holds a line */
+static inline void kseq_mem_line(kseq_mem_t *m, kseq_view_t *v, kstring_t *t, int n_lines)
+{
+	const char *q = (const char*)memchr(m->p, '\n', m->end - m->p);
+	size_t l = (q? q : m->end) - m->p;
+	if (l > 0 && m->p[l-1] == '\r') --l;
+	if (n_lines == 0) {
+		v->s = m->p, v->l = l;
+	} else {
+		if (n_lines == 1) t->l = 0, kseq_mem_append(t, v->s, v->l);
+		kseq_mem_append(t, m->p, l);
+		v->s = t->s, v->l = t->l;
+	}
+	m->p = q? q + 1 : m->end;
+}
+
+static inline int kseq_mem_read(kseq_mem_t *m)
+{
+	const char *q;
+	int c, n_lines;
+	if (m->last_char == 0) { /* then jump to the next header line */
+		while (m->p < m->end && *m->p != '>' && *m->p != '@') ++m->p;
+		if (m->p == m->end) return -1;
+		++m->p;
+	}
+	m->last_char = 0;
+	m->comment.l = m->seq.l = m->qual.l = 0;
+	if (m->p == m->end) return -1;
+	for (q = m->p; q < m->end && !isspace((unsigned char)*q); ++q);
+	m->name.s = m->p, m->name.l = q - m->p;
+	m->p = q < m->end? q + 1 : q;
+	if (q < m->end && *q != '\n') kseq_mem_line(m, &m->comment, 0, 0);
+	m->seq.s = m->p;
+	for (c = -1, n_lines = 0; m->p < m->end; ) { /* sequence lines */
+		c = (unsigned char)*m->p;
+		if (c == '>' || c == '+' || c == '@') {
+			++m->p;
+			break;
+		}
+		c = -1;
+		if (*m->p == '\n') { ++m->p; continue; } /* skip empty lines */
+		kseq_mem_line(m, &m->seq, &m->tmp[0], n_lines++);
+	}
+	if (c == '>' || c == '@') m->last_char = c;
+	if (c != '+') return m->seq.l; /* FASTA */
+	if ((q = (const char*)memchr(m->p, '\n', m->end - m->p)) == 0) { /* no quality string */
+		m->p = m->end;
+		return -2;
+	}
+	m->p = q + 1;
+	for (n_lines = 0; m->p < m->end && (n_lines == 0 || m->qual.l < m->seq.l); )
+		kseq_mem_line(m, &m->qual, &m->tmp[1], n_lines++);
+	if (m->seq.l != m->qual.l) return -2; /* error: qual string is of a different length */
+	return m->seq.l;
+}
+
+/* kseq_mem_split() splits _buf_ into _n_ ranges of similar sizes that start
+ * at record boundaries, such that the ranges can be parsed concurrently by
+ * kseq_mem_init(buf + off[i], off[i+1] - off[i]), for example under kt_for().
+ * _off_ must have room for n+1 offsets. Ranges may be empty. For FASTQ, a
+ * line starting with '@' is taken as a header only if it is followed by a
+ * sequence line, a '+' line and a quality line of the same length, which
+ * rejects quality strings starting with '@'. Multi-line FASTQ is not
+ * supported; multi-line FASTA is. */
+
+/* Return the length of the line at _p_ without the line ending; set *next to the next line */
+static inline size_t kseq_mem_line_len(const char *p, const char *end, const char **next)
+{
+	const char *q = (const char*)memchr(p, '\n', end - p);
+	size_t l = (q? q : end) - p;
+	if (l > 0 && p[l-1] == '\r') --l;
+	*next = q? q + 1 : end;
+	return l;
+}
+
+/* Return the offset of the first record starting at or after _pos_, or _len_ */
+static inline size_t kseq_mem_sync(const char *buf, size_t len, size_t pos)
+{
+	const char *p, *next, *end = buf + len;
+	int is_fq;
+	if (pos == 0 || pos >= len) return pos < len? pos : len;
+	for (p = buf; p < end && *p != '>' && *p != '@'; ++p); // the first header character decides the format, as in kseq_read()
+	is_fq = (p < end && *p == '@');
+	if (buf[pos-1] == '\n') p = buf + pos;
+	else kseq_mem_line_len(buf + pos, end, &p);
+	for (; p < end; kseq_mem_line_len(p, end, &p)) {
+		const char *q;
+		size_t l_seq;
+		if (*p != (is_fq? '@' : '>')) continue;
+		if (!is_fq) break;
+		kseq_mem_line_len(p, end, &q);
+		l_seq = kseq_mem_line_len(q, end, &q);
+		if (q == end || *q != '+') continue;
+		kseq_mem_line_len(q, end, &q);
+		if (q < end && kseq_mem_line_len(q, end, &next) == l_seq) break;
+	}
+	return p - buf;
+}
+
+static inline void kseq_mem_split(const void *buf, size_t len, int n, size_t *off)
+{
+	int i;
+	off[0] = 0, off[n] = len;
+	for (i = 1; i < n; ++i)
+		off[i] = kseq_mem_sync((const char*)buf, len, len / n * i);
+}
+
+/****************************
+ * Packed nucleotide output *
+ ****************************/
+
+/* Sequences can be stored with 2 bits (A/C/G/T => 0/1/2/3; 4 bases per byte)
+ * or 4 bits (the BAM encoding "=ACMGRSVTWYHKDBN"; 2 bases per byte) per base.
+ * The first base is stored in the most significant bits. Bases other than
+ * A/C/G/T, case-insensitively, are recorded as runs [st,en) in p->run; they
+ * are encoded as 0 with 2 bits.
+ *
+ * To pack while parsing, set seq->pack.bits to 2 or 4 after kseq_init().
+ * kseq_read() then encodes each sequence line straight from the stream
+ * buffer into seq->pack, with no extra pass, and never fills seq->seq, so
+ * the packed array is the only copy of the sequence. kseq_read_batch() and
+ * kseq_read_pair() copy seq->seq and need packing off.
+ *
+ * kseq_pack() is a separate pass over a sequence that is already in memory.
+ * Use it with kseq_mem_read(), where the sequence of a single-line record
+ * points into the input buffer and packing it makes no copy in ASCII. */
+
+typedef struct {
+	size_t st, en;
+} kseq_run_t;
+
+typedef struct {
+	int bits; // 2 or 4
+	size_t l, m; // sequence length and the capacity of s in bytes
+	unsigned char *s;
+	size_t n_run, m_run;
+	kseq_run_t *run; // runs of non-ACGT bases
+} kseq_pack_t;
+
+#define kseq_pack_get(p, i) ((p)->bits == 2? (p)->s[(i)>>2] >> ((~(i)&3)<<1) & 3 : (p)->s[(i)>>1] >> ((~(i)&1)<<2) & 0xf)
+
+static const unsigned char kseq_nt16_table[256] klib_unused = {
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  0, 15, 15,
+	15,  1, 14,  2, 13, 15, 15,  4, 11, 15, 15, 12, 15,  3, 15, 15,
+	15, 15,  5,  6,  8, 15,  7,  9, 15, 10, 15, 15, 15, 15, 15, 15,
+	15,  1, 14,  2, 13, 15, 15,  4, 11, 15, 15, 12, 15,  3, 15, 15,
+	15, 15,  5,  6,  8, 15,  7,  9, 15, 10, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15
+};
+
+static const unsigned char kseq_nt4_table[256] klib_unused = {
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+};
+
+static inline void kseq_pack_destroy(kseq_pack_t *p)
+{
+	if (!p) return;
+	free(p->s); free(p->run);
+	p->s = 0, p->run = 0, p->l = p->m = p->n_run = p->m_run = 0;
+}
+
+static inline void kseq_pack_add_run(kseq_pack_t *p, size_t i)
+{
+	if (p->n_run > 0 && p->run[p->n_run-1].en == i) {
+		++p->run[p->n_run-1].en;
+		return;
+	}
+	if (p->n_run == p->m_run) {
+		p->m_run = p->m_run? p->m_run + (p->m_run>>1) : 16;
+		p->run = (kseq_run_t*)realloc(p->run, p->m_run * sizeof(kseq_run_t));
+	}
+	p->run[p->n_run].st = i, p->run[p->n_run++].en = i + 1;
+}
+
+static inline void kseq_pack_put(kseq_pack_t *p, size_t i, unsigned char c) /* encode one base at position i */
+{
+	unsigned char x;
+	if (p->bits == 2) {
+		if ((x = kseq_nt4_table[c]) > 3) kseq_pack_add_run(p, i), x = 0;
+		if ((i & 3) == 0) p->s[i>>2] = 0;
+		p->s[i>>2] |= x << ((~i&3)<<1);
+	} else {
+		if (kseq_nt4_table[c] > 3) kseq_pack_add_run(p, i);
+		if ((i & 1) == 0) p->s[i>>1] = 0;
+		p->s[i>>1] |= kseq_nt16_table[c] << ((~i&1)<<2);
+	}
+}
+
+/* Append _l_ bases to _p_, whose p->bits must be set */
+static inline void kseq_pack_append(kseq_pack_t *p, const char *seq, size_t l)
+{
+	const unsigned char *s = (const unsigned char*)seq;
+	size_t i = 0, k = p->l, n = p->bits == 2? (k + l + 3) >> 2 : (k + l + 1) >> 1;
+	if (p->m < n) {
+		p->m = n;
+		kroundup32(p->m);
+		p->s = (unsigned char*)realloc(p->s, p->m);
+	}
+	if (p->bits == 2) {
+		for (; i < l && (k + i) & 3; ++i) kseq_pack_put(p, k + i, s[i]);
+		for (; i + 4 <= l; i += 4) { /* runs are rare; check 4 bases at once */
+			unsigned char c0 = kseq_nt4_table[s[i]], c1 = kseq_nt4_table[s[i+1]], c2 = kseq_nt4_table[s[i+2]], c3 = kseq_nt4_table[s[i+3]];
+			if ((c0 | c1 | c2 | c3) & 4) {
+				kseq_pack_put(p, k + i, s[i]), kseq_pack_put(p, k + i + 1, s[i+1]);
+				kseq_pack_put(p, k + i + 2, s[i+2]), kseq_pack_put(p, k + i + 3, s[i+3]);
+			} else p->s[(k + i) >> 2] = c0 << 6 | c1 << 4 | c2 << 2 | c3;
+		}
+	} else {
+		if (i < l && (k & 1)) kseq_pack_put(p, k, s[i++]);
+		for (; i + 2 <= l; i += 2) {
+			if ((kseq_nt4_table[s[i]] | kseq_nt4_table[s[i+1]]) & 4)
+				kseq_pack_put(p, k + i, s[i]), kseq_pack_put(p, k + i + 1, s[i+1]);
+			else p->s[(k + i) >> 1] = kseq_nt16_table[s[i]] << 4 | kseq_nt16_table[s[i+1]];
+		}
+	}
+	for (; i < l; ++i) kseq_pack_put(p, k + i, s[i]);
+	p->l = k + l;
+}
+
+static inline void kseq_pack(kseq_pack_t *p, const char *seq, size_t l, int bits)
+{
+	p->bits = bits, p->l = p->n_run = 0;
+	kseq_pack_append(p, seq, l);
+}
 
 #endif
@@ -5,19 +5,32 @@
 #include <stdint.h>
 #include "kstring.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define ks_ctz(x) __builtin_ctz(x)
+#else
+static inline int ks_ctz(unsigned x)
+{
+	int n = 0;
+	while (!(x & 1)) x >>= 1, ++n;
+	return n;
+}
+#endif
+
 int kvsprintf(kstring_t *s, const char *fmt, va_list ap)
 {
 	va_list args;
 	int l;
 	va_copy(args, ap);
-	l = vsnprintf(s->s + s->l, s->m - s->l, fmt, args); // This line does not work with glibc 2.0. See `man snprintf'.
+	l = vsnprintf(s->s + s->l, ks_cap(s) - s->l, fmt, args); // This line does not work with glibc 2.0. See `man snprintf'.
 	va_end(args);
-	if (l + 1 > s->m - s->l) {
-		s->m = s->l + l + 2;
-		kroundup32(s->m);
-		s->s = (char*)realloc(s->s, s->m);
+	if (l + 1 > ks_cap(s) - s->l) {
+		if (ks_resize(s, s->l + l + 2) < 0) return -1;
 		va_copy(args, ap);
-		l = vsnprintf(s->s + s->l, s->m - s->l, fmt, args);
+		l = vsnprintf(s->s + s->l, ks_cap(s) - s->l, fmt, args);
 		va_end(args);
 	}
 	s->l += l;
@@ -34,43 +47,103 @@ int ksprintf(kstring_t *s, const char *fmt, ...)
 	return l;
 }
 
+static inline const unsigned char *ks_tok_scan(const unsigned char *p, const unsigned char *end, const ks_tokaux_t *aux)
+{
+	if (aux->sep < 0) {
+		for (; p < end; ++p)
+			if (aux->tab[*p>>6]>>(*p&0x3f)&1) break;
+	} else {
+		for (; p < end; ++p)
+			if (*p == aux->sep) break;
+	}
+	return p;
+}
+
+// return the first separator, or a position less than 16 bytes before the end
+static inline const unsigned char *ks_tok_scan16(const unsigned char *p, const unsigned char *end, const ks_tokaux_t *aux)
+{
+#ifdef __SSE2__
+	if (aux->n_seps <= 8) {
+		for (; p + 16 <= end; p += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i*)p);
+			int k, m = 0;
+			for (k = 0; k < aux->n_seps; ++k)
+				m |= _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8(aux->seps[k])));
+			if (m) return p + ks_ctz(m);
+		}
+	}
+#endif
+	return p;
+}
+
 char *kstrtok(const char *str, const char *sep_in, ks_tokaux_t *aux)
 {
-	const unsigned char *p, *start, *sep = (unsigned char *) sep_in;
+	const unsigned char *p, *start, *end, *sep = (unsigned char *) sep_in;
 	if (sep) { // set up the table
 		if (str == 0 && aux->finished) return 0; // no need to set up if we have finished
 		aux->finished = 0;
 		if (sep[0] && sep[1]) {
-			aux->sep = -1;
+			aux->sep = -1, aux->n_seps = 0;
 			aux->tab[0] = aux->tab[1] = aux->tab[2] = aux->tab[3] = 0;
-			for (p = sep; *p; ++p) aux->tab[*p>>6] |= 1ull<<(*p&0x3f);
-		} else aux->sep = sep[0];
+			for (p = sep; *p; ++p) {
+				aux->tab[*p>>6] |= 1ull<<(*p&0x3f);
+				if (aux->n_seps < 8) aux->seps[aux->n_seps] = *p;
+				++aux->n_seps;
+			}
+		} else aux->sep = sep[0], aux->seps[0] = sep[0], aux->n_seps = 1;
 	}
 	if (aux->finished) return 0;
-	else if (str) start = (unsigned char *) str, aux->finished = 0;
+	else if (str) start = (unsigned char *) str, aux->finished = 0, aux->end = str + strlen(str);
 	else start = (unsigned char *) aux->p + 1;
-	if (aux->sep < 0) {
-		for (p = start; *p; ++p)
-			if (aux->tab[*p>>6]>>(*p&0x3f)&1) break;
-	} else {
-		for (p = start; *p; ++p)
-			if (*p == aux->sep) break;
-	}
+	end = (const unsigned char *) aux->end;
+	p = ks_tok_scan(start, start + 16 < end? start + 16 : end, aux); // short tokens are common
+	if (p == start + 16) // then look at 16 bytes at a time
+		p = ks_tok_scan(ks_tok_scan16(p, end, aux), end, aux);
 	aux->p = (const char *) p; // end of token
-	if (*p == 0) aux->finished = 1; // no more tokens
+	if (p == end) aux->finished = 1; // no more tokens
 	return (char*)start;
 }
 
+/* Return the bit mask of separators in s[0..n) for ksplit_core(). With
+ * delimiter==0, separators are isspace() characters in the C locale. */
+static inline unsigned ks_sep_mask(const char *s, int n, int delimiter)
+{
+	unsigned m = 0;
+	int i;
+	for (i = 0; i < n; ++i) {
+		unsigned char c = s[i];
+		if (delimiter == 0? (c == ' ' || (unsigned char)(c - 9) <= 4) : c == (unsigned char)delimiter)
+			m |= 1u << i;
+	}
+	return m;
+}
+
+static inline unsigned ks_sep_mask16(const char *s, int delimiter)
+{
+#ifdef __SSE2__
+	__m128i x = _mm_loadu_si128((const __m128i*)s);
+	if (delimiter == 0) {
+		__m128i y = _mm_sub_epi8(x, _mm_set1_epi8(9)); // '\t'..'\r' => 0..4
+		__m128i m = _mm_cmpeq_epi8(_mm_min_epu8(y, _mm_set1_epi8(4)), y);
+		return _mm_movemask_epi8(_mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(' '))));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8((char)delimiter)));
+#else
+	return ks_sep_mask(s, 16, delimiter);
+#endif
+}
+
 // s MUST BE a null terminated string; l = strlen(s)
 int ksplit_core(char *s, int delimiter, int *_max, int **_offsets)
 {
-	int i, n, max, last_char, last_start, *offsets, l;
+	int i, e, n, max, last_start, *offsets, l;
+	unsigned in_field = 0; // whether s[i-1] is in a field
 	n = 0; max = *_max; offsets = *_offsets;
 	l = strlen(s);
 	
 #define __ksplit_aux do {						\
 		if (_offsets) {						\
-			s[i] = 0;					\
+			s[e] = 0;					\
 			if (n == max) {					\
 				int *tmp;				\
 				max = max? max<<1 : 2;			\
@@ -86,21 +159,26 @@ int ksplit_core(char *s, int delimiter, int *_max, int **_offsets)
 		} else ++n;						\
 	} while (0)
 
-	for (i = 0, last_char = last_start = 0; i <= l; ++i) {
-		if (delimiter == 0) {
-			if (isspace(s[i]) || s[i] == 0) {
-				if (isgraph(last_char)) __ksplit_aux; // the end of a field
+	// find separators 16 bytes at a time; a field starts at a non-separator after a separator and ends at the opposite
+	for (i = last_start = 0; i < l; i += 16) {
+		int w = l - i < 16? l - i : 16;
+		unsigned valid = w == 16? 0xffffu : (1u << w) - 1;
+		unsigned f = ~(w == 16? ks_sep_mask16(s + i, delimiter) : ks_sep_mask(s + i, w, delimiter)) & valid;
+		unsigned st = f & ~(f << 1 | in_field), en = ~f & valid & (f << 1 | in_field), x;
+		in_field = f >> (w - 1) & 1;
+		for (x = st | en; x; x &= x - 1) {
+			int j = ks_ctz(x);
+			if (st >> j & 1) {
+				last_start = i + j;
 			} else {
-				if (isspace(last_char) || last_char == 0) last_start = i;
-			}
-		} else {
-			if (s[i] == delimiter || s[i] == 0) {
-				if (last_char != 0 && last_char != delimiter) __ksplit_aux; // the end of a field
-			} else {
-				if (last_char == delimiter || last_char == 0) last_start = i;
+				e = i + j;
+				if (delimiter || isgraph(s[e-1])) __ksplit_aux; // the end of a field
 			}
 		}
-		last_char = s[i];
+	}
+	if (in_field) {
+		e = l;
+		if (delimiter || isgraph(s[e-1])) __ksplit_aux;
 	}
 	*_max = max; *_offsets = offsets;
 	return n;
@@ -111,8 +189,8 @@ int kgetline(kstring_t *s, kgets_func *fgets_fn, void *fp)
 	size_t l0 = s->l;
 
 	while (s->l == l0 || s->s[s->l-1] != '\n') {
-		if (s->m - s->l < 200) ks_resize(s, s->m + 200);
-		if (fgets_fn(s->s + s->l, s->m - s->l, fp) == NULL) break;
+		if (ks_cap(s) - s->l < 200) ks_resize(s, ks_cap(s) + 200);
+		if (fgets_fn(s->s + s->l, ks_cap(s) - s->l, fp) == NULL) break;
 		s->l += strlen(s->s + s->l);
 	}
 
@@ -126,6 +204,241 @@ int kgetline(kstring_t *s, kgets_func *fgets_fn, void *fp)
 	return 0;
 }
 
+/********************************************
+ * Shortest round-trip double formatting    *
+ ********************************************/
+
+/* Grisu2 by Florian Loitsch, following the implementation by Milo Yip. The
+ * digits always convert back to the same double, and are the shortest such
+ * digits for nearly all values. */
+
+typedef struct {
+	uint64_t f;
+	int e;
+} ks_diyfp_t;
+
+static const ks_diyfp_t ks_cached_pow10[] = { // 10^-348, 10^-340, ..., 10^340
+	{0xfa8fd5a0081c0288ULL, -1220}, {0xbaaee17fa23ebf76ULL, -1193}, {0x8b16fb203055ac76ULL, -1166}, {0xcf42894a5dce35eaULL, -1140},
+	{0x9a6bb0aa55653b2dULL, -1113}, {0xe61acf033d1a45dfULL, -1087}, {0xab70fe17c79ac6caULL, -1060}, {0xff77b1fcbebcdc4fULL, -1034},
+	{0xbe5691ef416bd60cULL, -1007}, {0x8dd01fad907ffc3cULL, -980}, {0xd3515c2831559a83ULL, -954}, {0x9d71ac8fada6c9b5ULL, -927},
+	{0xea9c227723ee8bcbULL, -901}, {0xaecc49914078536dULL, -874}, {0x823c12795db6ce57ULL, -847}, {0xc21094364dfb5637ULL, -821},
+	{0x9096ea6f3848984fULL, -794}, {0xd77485cb25823ac7ULL, -768}, {0xa086cfcd97bf97f4ULL, -741}, {0xef340a98172aace5ULL, -715},
+	{0xb23867fb2a35b28eULL, -688}, {0x84c8d4dfd2c63f3bULL, -661}, {0xc5dd44271ad3cdbaULL, -635}, {0x936b9fcebb25c996ULL, -608},
+	{0xdbac6c247d62a584ULL, -582}, {0xa3ab66580d5fdaf6ULL, -555}, {0xf3e2f893dec3f126ULL, -529}, {0xb5b5ada8aaff80b8ULL, -502},
+	{0x87625f056c7c4a8bULL, -475}, {0xc9bcff6034c13053ULL, -449}, {0x964e858c91ba2655ULL, -422}, {0xdff9772470297ebdULL, -396},
+	{0xa6dfbd9fb8e5b88fULL, -369}, {0xf8a95fcf88747d94ULL, -343}, {0xb94470938fa89bcfULL, -316}, {0x8a08f0f8bf0f156bULL, -289},
+	{0xcdb02555653131b6ULL, -263}, {0x993fe2c6d07b7facULL, -236}, {0xe45c10c42a2b3b06ULL, -210}, {0xaa242499697392d3ULL, -183},
+	{0xfd87b5f28300ca0eULL, -157}, {0xbce5086492111aebULL, -130}, {0x8cbccc096f5088ccULL, -103}, {0xd1b71758e219652cULL, -77},
+	{0x9c40000000000000ULL, -50}, {0xe8d4a51000000000ULL, -24}, {0xad78ebc5ac620000ULL, 3}, {0x813f3978f8940984ULL, 30},
+	{0xc097ce7bc90715b3ULL, 56}, {0x8f7e32ce7bea5c70ULL, 83}, {0xd5d238a4abe98068ULL, 109}, {0x9f4f2726179a2245ULL, 136},
+	{0xed63a231d4c4fb27ULL, 162}, {0xb0de65388cc8ada8ULL, 189}, {0x83c7088e1aab65dbULL, 216}, {0xc45d1df942711d9aULL, 242},
+	{0x924d692ca61be758ULL, 269}, {0xda01ee641a708deaULL, 295}, {0xa26da3999aef774aULL, 322}, {0xf209787bb47d6b85ULL, 348},
+	{0xb454e4a179dd1877ULL, 375}, {0x865b86925b9bc5c2ULL, 402}, {0xc83553c5c8965d3dULL, 428}, {0x952ab45cfa97a0b3ULL, 455},
+	{0xde469fbd99a05fe3ULL, 481}, {0xa59bc234db398c25ULL, 508}, {0xf6c69a72a3989f5cULL, 534}, {0xb7dcbf5354e9beceULL, 561},
+	{0x88fcf317f22241e2ULL, 588}, {0xcc20ce9bd35c78a5ULL, 614}, {0x98165af37b2153dfULL, 641}, {0xe2a0b5dc971f303aULL, 667},
+	{0xa8d9d1535ce3b396ULL, 694}, {0xfb9b7cd9a4a7443cULL, 720}, {0xbb764c4ca7a44410ULL, 747}, {0x8bab8eefb6409c1aULL, 774},
+	{0xd01fef10a657842cULL, 800}, {0x9b10a4e5e9913129ULL, 827}, {0xe7109bfba19c0c9dULL, 853}, {0xac2820d9623bf429ULL, 880},
+	{0x80444b5e7aa7cf85ULL, 907}, {0xbf21e44003acdd2dULL, 933}, {0x8e679c2f5e44ff8fULL, 960}, {0xd433179d9c8cb841ULL, 986},
+	{0x9e19db92b4e31ba9ULL, 1013}, {0xeb96bf6ebadf77d9ULL, 1039}, {0xaf87023b9bf0ee6bULL, 1066}
+};
+
+static const uint64_t ks_pow10_64[] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+	100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+	1000000000000000000ULL, 10000000000000000000ULL };
+
+static inline ks_diyfp_t ks_diyfp_mul(ks_diyfp_t x, ks_diyfp_t y)
+{
+	const uint64_t M32 = 0xffffffffULL;
+	uint64_t a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1ULL << 31); // rounded
+	ks_diyfp_t r;
+	r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), r.e = x.e + y.e + 64;
+	return r;
+}
+
+static inline ks_diyfp_t ks_diyfp_norm(ks_diyfp_t x)
+{
+	while (!(x.f & 1ULL<<63)) x.f <<= 1, --x.e;
+	return x;
+}
+
+static inline void ks_grisu_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w))
+		--buf[len - 1], rest += ten_kappa;
+}
+
+/* Write the digits of a positive finite double to _buf_; return the number of
+ * digits. The value is digits * 10^(*K). */
+static int ks_grisu2(double d, char *buf, int *K)
+{
+	const uint64_t hidden = 1ULL<<52, frac_mask = hidden - 1;
+	ks_diyfp_t v, w, wp, wm, c, one, W, Wp, Wm;
+	uint64_t u, p2, delta, wp_w;
+	uint32_t p1;
+	int kappa, len = 0, k, idx;
+	double dk;
+	memcpy(&u, &d, 8);
+	if (u >> 52 & 0x7ff) v.f = (u & frac_mask) + hidden, v.e = (int)(u >> 52 & 0x7ff) - 1075;
+	else v.f = u & frac_mask, v.e = -1074;
+	// the normalized boundaries m+ and m-
+	wp.f = (v.f << 1) + 1, wp.e = v.e - 1;
+	while (!(wp.f & hidden<<1)) wp.f <<= 1, --wp.e;
+	wp.f <<= 10, wp.e -= 10;
+	if (v.f == hidden) wm.f = (v.f << 2) - 1, wm.e = v.e - 2;
+	else wm.f = (v.f << 1) - 1, wm.e = v.e - 1;
+	wm.f <<= wm.e - wp.e, wm.e = wp.e;
+	// scale by a cached power of 10 such that the exponent falls in [-60,-32]
+	dk = (-61 - wp.e) * 0.30102999566398114 + 347;
+	k = (int)dk;
+	if (dk - k > 0.0) ++k;
+	idx = (k >> 3) + 1;
+	*K = -(-348 + idx * 8);
+	c = ks_cached_pow10[idx];
+	w = ks_diyfp_norm(v);
+	W = ks_diyfp_mul(w, c), Wp = ks_diyfp_mul(wp, c), Wm = ks_diyfp_mul(wm, c);
+	++Wm.f, --Wp.f;
+	// generate digits
+	delta = Wp.f - Wm.f, wp_w = Wp.f - W.f;
+	one.f = 1ULL << -Wp.e, one.e = Wp.e;
+	p1 = (uint32_t)(Wp.f >> -one.e), p2 = Wp.f & (one.f - 1);
+	for (kappa = 1; kappa < 10 && p1 >= ks_pow10_64[kappa]; ++kappa);
+	while (kappa > 0) {
+		uint32_t dg = (uint32_t)(p1 / ks_pow10_64[kappa - 1]);
+		uint64_t tmp;
+		p1 %= (uint32_t)ks_pow10_64[kappa - 1];
+		if (dg || len) buf[len++] = '0' + dg;
+		--kappa;
+		tmp = ((uint64_t)p1 << -one.e) + p2;
+		if (tmp <= delta) {
+			*K += kappa;
+			ks_grisu_round(buf, len, delta, tmp, ks_pow10_64[kappa] << -one.e, wp_w);
+			return len;
+		}
+	}
+	for (;;) {
+		char dg;
+		p2 *= 10, delta *= 10;
+		dg = (char)(p2 >> -one.e);
+		if (dg || len) buf[len++] = '0' + dg;
+		p2 &= one.f - 1;
+		--kappa;
+		if (p2 < delta) {
+			*K += kappa;
+			ks_grisu_round(buf, len, delta, p2, one.f, wp_w * (-kappa < 20? ks_pow10_64[-kappa] : 0));
+			return len;
+		}
+	}
+}
+
+int kputd(double d, kstring_t *s)
+{
+	char buf[32], *p = buf;
+	int len, K, e, i;
+	uint64_t u;
+	memcpy(&u, &d, 8);
+	if (u >> 63) *p++ = '-', u &= ~(1ULL<<63), memcpy(&d, &u, 8);
+	if ((u >> 52 & 0x7ff) == 0x7ff) { // inf or nan
+		memcpy(p, (u & ((1ULL<<52) - 1))? "nan" : "inf", 3);
+		return kputsn(buf, p + 3 - buf, s) < 0? EOF : 0;
+	}
+	if (u == 0) {
+		*p++ = '0';
+		return kputsn(buf, p - buf, s) < 0? EOF : 0;
+	}
+	len = ks_grisu2(d, p, &K);
+	e = len + K - 1; // the decimal exponent in scientific notation
+	if (e >= -4 && e < 17) { // fixed notation, as with %.17g
+		if (e >= len - 1) { // an integer
+			memset(p + len, '0', e - len + 1);
+			p += e + 1;
+		} else if (e >= 0) {
+			memmove(p + e + 2, p + e + 1, len - e - 1);
+			p[e + 1] = '.';
+			p += len + 1;
+		} else {
+			memmove(p + 1 - e, p, len);
+			p[0] = '0', p[1] = '.';
+			for (i = 2; i < 1 - e; ++i) p[i] = '0';
+			p += len + 1 - e;
+		}
+	} else { // scientific notation, with at least two exponent digits
+		if (len > 1) memmove(p + 2, p + 1, len - 1), p[1] = '.', ++len;
+		p += len;
+		*p++ = 'e', *p++ = e < 0? '-' : '+';
+		if (e < 0) e = -e;
+		if (e >= 100) *p++ = '0' + e / 100;
+		*p++ = '0' + e / 10 % 10, *p++ = '0' + e % 10;
+	}
+	return kputsn(buf, p - buf, s) < 0? EOF : 0;
+}
+
+/*******************************
+ * Parsing numbers from a span *
+ *******************************/
+
+double kstrtod(const char *str, int l, const char **end)
+{
+	static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	const char *p = str, *e = str + l;
+	uint64_t x = 0;
+	int neg = 0, n_dig = 0, n_frac = 0, exp = 0;
+	if (p < e && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+	for (; p < e && *p >= '0' && *p <= '9'; ++p, ++n_dig)
+		x = x * 10 + (*p - '0');
+	if (p < e && *p == '.')
+		for (++p; p < e && *p >= '0' && *p <= '9'; ++p, ++n_dig, ++n_frac)
+			x = x * 10 + (*p - '0');
+	if (n_dig > 0 && p < e && (*p == 'e' || *p == 'E')) {
+		const char *r = p + 1;
+		int eneg = 0, n = 0;
+		if (r < e && (*r == '-' || *r == '+')) eneg = (*r++ == '-');
+		for (; r < e && *r >= '0' && *r <= '9'; ++r, ++n)
+			if (exp < 100000) exp = exp * 10 + (*r - '0');
+		if (n > 0) p = r, exp = eneg? -exp : exp;
+		else exp = 0; // not an exponent
+	}
+	exp -= n_frac;
+	// Clinger's fast path: both x and 10^|exp| are exact doubles; hexadecimal goes to strtod()
+	if (n_dig > 0 && n_dig <= 19 && x <= 1ULL<<53 && exp >= -22 && exp <= 22 && !(p < e && (*p == 'x' || *p == 'X'))) {
+		double y = exp >= 0? (double)x * pow10[exp] : (double)x / pow10[-exp];
+		if (end) *end = p;
+		return neg? -y : y;
+	} else { // fall back to strtod() on a null-terminated copy of the number only, not the rest of the span
+		char buf[64], *t, *te;
+		const char *q = str;
+		double y;
+		while (q < e && isspace((unsigned char)*q)) ++q;
+		if (q < e && (*q == '-' || *q == '+')) ++q;
+		if (q < e && isalpha((unsigned char)*q)) { // inf, infinity, nan or nan(...)
+			while (q < e && isalnum((unsigned char)*q)) ++q;
+			if (q < e && *q == '(')
+				while (q < e && *q++ != ')');
+		} else {
+			for (; q < e; ++q) {
+				int c = (unsigned char)*q;
+				if ((c == '-' || c == '+') && (q[-1] == 'e' || q[-1] == 'E' || q[-1] == 'p' || q[-1] == 'P')) continue;
+				if (!isxdigit(c) && c != '.' && c != 'x' && c != 'X' && c != 'p' && c != 'P') break;
+			}
+		}
+		l = q - str;
+		t = l < 64? buf : (char*)malloc(l + 1);
+		if (t == 0) {
+			if (end) *end = str;
+			return 0.0;
+		}
+		memcpy(t, str, l);
+		t[l] = 0;
+		y = strtod(t, &te);
+		if (end) *end = str + (te - t);
+		if (t != buf) free(t);
+		return y;
+	}
+}
+
 /**********************
  * Boyer-Moore search *
  **********************/
@@ -204,6 +517,111 @@ char *kstrnstr(const char *str, const char *pat, int n, int **_prep)
 	return (char*)kmemmem(str, n, pat, strlen(pat), _prep);
 }
 
+/*****************************
+ * Aho-Corasick multi-search *
+ *****************************/
+
+struct ks_ac_s {
+	int n_pat, n_state, n_class;
+	int *len; // pattern lengths
+	int *next; // next pattern with the same string, or -1
+	int *out; // out[s]: a pattern ending at state s, or -1
+	int *hit; // hit[s]: s if out[s]>=0, or the nearest suffix state with an output, or -1
+	int *dict; // dict[s]: hit[] of the longest proper suffix of s
+	int *delta; // the DFA: delta[s*n_class + cls[c]]
+	ubyte_t cls[256]; // byte classes; bytes absent from all patterns share class 0
+};
+
+ks_ac_t *ks_ac_init(int n, const char *const *pat, const int *len)
+{
+	ks_ac_t *ac;
+	int i, j, k, sum = 0, *fail, *queue, head, tail;
+	ac = (ks_ac_t*)calloc(1, sizeof(ks_ac_t));
+	ac->n_pat = n;
+	ac->len = (int*)malloc(n * 2 * sizeof(int));
+	ac->next = ac->len + n;
+	for (i = 0; i < n; ++i) {
+		ac->len[i] = len? len[i] : (int)strlen(pat[i]);
+		sum += ac->len[i];
+		for (j = 0; j < ac->len[i]; ++j) ac->cls[(ubyte_t)pat[i][j]] = 1;
+	}
+	for (i = 0, ac->n_class = 1; i < 256; ++i)
+		if (ac->cls[i]) ac->cls[i] = ac->n_class++;
+	// build the trie; -1 marks a missing transition
+	ac->delta = (int*)malloc((size_t)(sum + 1) * ac->n_class * sizeof(int));
+	ac->out = (int*)malloc((sum + 1) * 3 * sizeof(int));
+	ac->hit = ac->out + sum + 1, ac->dict = fail = ac->hit + sum + 1;
+	for (k = 0; k < ac->n_class; ++k) ac->delta[k] = -1;
+	ac->out[0] = -1, ac->n_state = 1;
+	for (i = 0; i < n; ++i) {
+		int s = 0;
+		ac->next[i] = -1;
+		if (ac->len[i] == 0) continue; // never matches
+		for (j = 0; j < ac->len[i]; ++j) {
+			int *t = &ac->delta[s * ac->n_class + ac->cls[(ubyte_t)pat[i][j]]];
+			if (*t < 0) {
+				*t = ac->n_state++;
+				for (k = 0; k < ac->n_class; ++k) ac->delta[*t * ac->n_class + k] = -1;
+				ac->out[*t] = -1;
+			}
+			s = *t;
+		}
+		ac->next[i] = ac->out[s], ac->out[s] = i;
+	}
+	// compute failure links in the BFS order and turn the trie into a DFA
+	queue = (int*)malloc(ac->n_state * sizeof(int));
+	head = tail = 0;
+	fail[0] = 0, ac->hit[0] = -1;
+	for (k = 0; k < ac->n_class; ++k) {
+		int *t = &ac->delta[k];
+		if (*t < 0) *t = 0;
+		else fail[*t] = 0, queue[tail++] = *t;
+	}
+	while (head < tail) {
+		int s = queue[head++], f = fail[s];
+		ac->hit[s] = ac->out[s] >= 0? s : ac->hit[f];
+		for (k = 0; k < ac->n_class; ++k) {
+			int *t = &ac->delta[s * ac->n_class + k];
+			if (*t < 0) *t = ac->delta[f * ac->n_class + k];
+			else fail[*t] = ac->delta[f * ac->n_class + k], queue[tail++] = *t;
+		}
+	}
+	free(queue);
+	for (i = 0; i < ac->n_state; ++i) // fail[] becomes dict[]
+		fail[i] = ac->out[i] >= 0? ac->hit[fail[i]] : -1;
+	ac->delta = (int*)realloc(ac->delta, (size_t)ac->n_state * ac->n_class * sizeof(int));
+	return ac;
+}
+
+void ks_ac_destroy(ks_ac_t *ac)
+{
+	if (ac == 0) return;
+	free(ac->len); free(ac->out); free(ac->delta); free(ac);
+}
+
+int ks_ac_search(const ks_ac_t *ac, const void *_str, int n, int *_max, ks_achit_t **_hits)
+{
+	const ubyte_t *str = (const ubyte_t*)_str;
+	const int *delta = ac->delta, *hit = ac->hit, *dict = ac->dict;
+	int i, s = 0, n_hits = 0, max = *_max;
+	ks_achit_t *hits = *_hits;
+	for (i = 0; i < n; ++i) {
+		int t, p;
+		s = delta[s * ac->n_class + ac->cls[str[i]]];
+		if (hit[s] < 0) continue;
+		for (t = hit[s]; t >= 0; t = dict[t]) // all patterns ending at i, the longest first
+			for (p = ac->out[t]; p >= 0; p = ac->next[p]) {
+				if (n_hits == max) {
+					max = max? max<<1 : 16;
+					hits = (ks_achit_t*)realloc(hits, max * sizeof(ks_achit_t));
+				}
+				hits[n_hits].pat = p, hits[n_hits++].pos = i + 1 - ac->len[p];
+			}
+	}
+	*_max = max, *_hits = hits;
+	return n_hits;
+}
+
 /***********************
  * The main() function *
  ***********************/
@@ -31,6 +31,7 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <limits.h>
 
 #ifndef kroundup32
 #define kroundup32(x) (--(x), (x)|=(x)>>1, (x)|=(x)>>2, (x)|=(x)>>4, (x)|=(x)>>8, (x)|=(x)>>16, ++(x))
@@ -50,7 +51,7 @@
  *       kstring_t str; ...; str.l = str.m = 0; str.s = NULL;
  * and either ownership of the underlying buffer should be given away before
  * the object disappears (see ks_release() below) or the kstring_t should be
- * destroyed with  free(str.s);  */
+ * destroyed with  free(str.s);  or ks_free(&str);  */
 #ifndef KSTRING_T
 #define KSTRING_T kstring_t
 typedef struct __kstring_t {
@@ -63,8 +64,17 @@ typedef struct {
 	uint64_t tab[4];
 	int sep, finished;
 	const char *p; // end of the current token
+	const char *end; // end of the string
+	int n_seps;
+	char seps[8]; // the first separators, for SIMD matching
 } ks_tokaux_t;
 
+typedef struct ks_ac_s ks_ac_t;
+
+typedef struct {
+	int pat, pos; // pattern index and the start position
+} ks_achit_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -76,6 +86,16 @@ extern "C" {
 	char *kstrnstr(const char *str, const char *pat, int n, int **_prep);
 	void *kmemmem(const void *_str, int n, const void *_pat, int m, int **_prep);
 
+	/* ks_ac_init() compiles n patterns into an Aho-Corasick automaton. If
+	 * len is NULL, patterns are null terminated. ks_ac_search() finds all
+	 * occurrences of all patterns in one pass over str[0..n), including
+	 * overlapping ones, and returns the number of hits. Like ksplit_core(),
+	 * it reuses and grows *_hits, which has room for *_max hits. Hits are
+	 * ordered by their end positions. */
+	ks_ac_t *ks_ac_init(int n, const char *const *pat, const int *len);
+	void ks_ac_destroy(ks_ac_t *ac);
+	int ks_ac_search(const ks_ac_t *ac, const void *str, int n, int *_max, ks_achit_t **_hits);
+
 	/* kstrtok() is similar to strtok_r() except that str is not
 	 * modified and both str and sep can be NULL. For efficiency, it is
 	 * actually recommended to set both to NULL in the subsequent calls
@@ -89,14 +109,70 @@ extern "C" {
 	typedef char *kgets_func(char *, int, void *);
 	int kgetline(kstring_t *s, kgets_func *fgets, void *fp);
 
+	/* kputd() appends the shortest decimal representation of d that reads
+	 * back as the same double, in the style of printf("%.17g") otherwise:
+	 * 0.1, 1e+100, -0, inf, nan. */
+	int kputd(double d, kstring_t *s);
+
+	/* kstrtod() is similar to strtod() but parses at most l bytes from
+	 * str, which needs not be null terminated. */
+	double kstrtod(const char *str, int l, const char **end);
+
 #ifdef __cplusplus
 }
 #endif
 
+/* kstring_sso_t is a kstring_t with an inline buffer for short strings and an
+ * optional allocator, such as krealloc() from kalloc.h with a kalloc pool.
+ * Pass &x.str to kputs() and the other functions in this file; allocation
+ * only happens when the string outgrows x.buf. The top bit of str.m marks
+ * such strings: functions outside kstring.h/kstring.c that grow a kstring_t
+ * must not be used on them, and they are freed with ks_free(), not free().
+ *       kstring_sso_t x;
+ *       ks_sso_init(&x, km, krealloc); // or ks_sso_init(&x, 0, 0) for malloc()
+ *       kputs("chr1", &x.str); ...; ks_free(&x.str);  */
+#ifndef KS_INLINE_SIZE
+#define KS_INLINE_SIZE 24
+#endif
+
+#define KS_SSO (~(~(size_t)0 >> 1)) // the flag in kstring_t::m
+#define ks_cap(s) ((s)->m & ~KS_SSO)
+
+typedef void *ks_realloc_f(void *km, void *ptr, size_t size); // frees ptr if size==0
+
+typedef struct {
+	kstring_t str; // must be the first member
+	void *km;
+	ks_realloc_f *realloc_fn; // NULL for realloc()
+	char buf[KS_INLINE_SIZE];
+} kstring_sso_t;
+
+static inline void ks_sso_init(kstring_sso_t *x, void *km, ks_realloc_f *realloc_fn)
+{
+	x->km = km, x->realloc_fn = realloc_fn;
+	x->str.l = 0, x->str.m = KS_INLINE_SIZE | KS_SSO, x->str.s = x->buf;
+	x->buf[0] = 0;
+}
+
+static inline int ks_resize_sso(kstring_t *s, size_t size)
+{
+	kstring_sso_t *x = (kstring_sso_t*)s;
+	char *tmp;
+	kroundup32(size);
+	if (s->s == x->buf) { // move out of the inline buffer
+		tmp = (char*)(x->realloc_fn? x->realloc_fn(x->km, 0, size) : malloc(size));
+		if (tmp) memcpy(tmp, x->buf, s->l < KS_INLINE_SIZE? s->l + 1 : KS_INLINE_SIZE);
+	} else tmp = (char*)(x->realloc_fn? x->realloc_fn(x->km, s->s, size) : realloc(s->s, size));
+	if (tmp == 0) return -1;
+	s->s = tmp, s->m = size | KS_SSO;
+	return 0;
+}
+
 static inline int ks_resize(kstring_t *s, size_t size)
 {
-	if (s->m < size) {
+	if (ks_cap(s) < size) {
 		char *tmp;
+		if (s->m & KS_SSO) return ks_resize_sso(s, size);
 		s->m = size;
 		kroundup32(s->m);
 		if ((tmp = (char*)realloc(s->s, s->m)))
@@ -107,6 +183,22 @@ static inline int ks_resize(kstring_t *s, size_t size)
 	return 0;
 }
 
+/* Free a kstring_t or the &str member of a kstring_sso_t, leaving it empty */
+static inline void ks_free(kstring_t *s)
+{
+	if (s->m & KS_SSO) {
+		kstring_sso_t *x = (kstring_sso_t*)s;
+		if (s->s != x->buf) {
+			if (x->realloc_fn) x->realloc_fn(x->km, s->s, 0);
+			else free(s->s);
+		}
+		ks_sso_init(x, x->km, x->realloc_fn);
+	} else {
+		free(s->s);
+		s->l = s->m = 0, s->s = 0;
+	}
+}
+
 static inline char *ks_str(kstring_t *s)
 {
 	return s->s;
@@ -120,7 +212,7 @@ static inline size_t ks_len(kstring_t *s)
 // Give ownership of the underlying buffer away to something else (making
 // that something else responsible for freeing it), leaving the kstring_t
 // empty and ready to be used again, or ready to go out of scope without
-// needing  free(str.s)  to prevent a memory leak.
+// needing  free(str.s)  to prevent a memory leak. Not for kstring_sso_t.
 static inline char *ks_release(kstring_t *s)
 {
 	char *ss = s->s;
@@ -131,15 +223,7 @@ static inline char *ks_release(kstring_t *s)
 
 static inline int kputsn(const char *p, int l, kstring_t *s)
 {
-	if (s->l + l + 1 >= s->m) {
-		char *tmp;
-		s->m = s->l + l + 2;
-		kroundup32(s->m);
-		if ((tmp = (char*)realloc(s->s, s->m)))
-			s->s = tmp;
-		else
-			return EOF;
-	}
+	if (ks_resize(s, s->l + l + 2) < 0) return EOF;
 	memcpy(s->s + s->l, p, l);
 	s->l += l;
 	s->s[s->l] = 0;
@@ -153,15 +237,7 @@ static inline int kputs(const char *p, kstring_t *s)
 
 static inline int kputc(int c, kstring_t *s)
 {
-	if (s->l + 1 >= s->m) {
-		char *tmp;
-		s->m = s->l + 2;
-		kroundup32(s->m);
-		if ((tmp = (char*)realloc(s->s, s->m)))
-			s->s = tmp;
-		else
-			return EOF;
-	}
+	if (ks_resize(s, s->l + 2) < 0) return EOF;
 	s->s[s->l++] = c;
 	s->s[s->l] = 0;
 	return c;
@@ -169,98 +245,90 @@ static inline int kputc(int c, kstring_t *s)
 
 static inline int kputc_(int c, kstring_t *s)
 {
-	if (s->l + 1 > s->m) {
-		char *tmp;
-		s->m = s->l + 1;
-		kroundup32(s->m);
-		if ((tmp = (char*)realloc(s->s, s->m)))
-			s->s = tmp;
-		else
-			return EOF;
-	}
+	if (ks_resize(s, s->l + 1) < 0) return EOF;
 	s->s[s->l++] = c;
 	return 1;
 }
 
 static inline int kputsn_(const void *p, int l, kstring_t *s)
 {
-	if (s->l + l > s->m) {
-		char *tmp;
-		s->m = s->l + l;
-		kroundup32(s->m);
-		if ((tmp = (char*)realloc(s->s, s->m)))
-			s->s = tmp;
-		else
-			return EOF;
-	}
+	if (ks_resize(s, s->l + l) < 0) return EOF;
 	memcpy(s->s + s->l, p, l);
 	s->l += l;
 	return l;
 }
 
-static inline int kputw(int c, kstring_t *s)
+static inline int ks_u64len(uint64_t x) // the number of decimal digits
 {
-	char buf[16];
-	int i, l = 0;
-	unsigned int x = c;
-	if (c < 0) x = -x;
-	do { buf[l++] = x%10 + '0'; x /= 10; } while (x > 0);
-	if (c < 0) buf[l++] = '-';
-	if (s->l + l + 1 >= s->m) {
-		char *tmp;
-		s->m = s->l + l + 2;
-		kroundup32(s->m);
-		if ((tmp = (char*)realloc(s->s, s->m)))
-			s->s = tmp;
-		else
-			return EOF;
-	}
-	for (i = l - 1; i >= 0; --i) s->s[s->l++] = buf[i];
+	int n;
+	uint64_t y;
+	for (n = 1, y = 10; n < 20 && x >= y; ++n, y *= 10);
+	return n;
+}
+
+/* Write the n=ks_u64len(x) decimal digits of _x_ to buf[0..n), two digits at
+ * a time from a table. */
+static inline int ks_u64toa_(uint64_t x, int n, char *buf)
+{
+	static const char d2[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+	char *p;
+	for (p = buf + n; x >= 100; x /= 100)
+		p -= 2, memcpy(p, d2 + (x % 100) * 2, 2);
+	if (x >= 10) memcpy(p - 2, d2 + x * 2, 2);
+	else *(p - 1) = '0' + x;
+	return n;
+}
+
+static inline int ks_u64toa(uint64_t x, char *buf) // _buf_ must have room for 20 bytes
+{
+	return ks_u64toa_(x, ks_u64len(x), buf);
+}
+
+static inline int kputu64_(uint64_t x, int neg, kstring_t *s)
+{
+	int n = ks_u64len(x);
+	if (ks_resize(s, s->l + n + neg + 1) < 0) return EOF;
+	if (neg) s->s[s->l++] = '-';
+	s->l += ks_u64toa_(x, n, s->s + s->l);
 	s->s[s->l] = 0;
 	return 0;
 }
 
+static inline int kputw(int c, kstring_t *s)
+{
+	return kputu64_(c < 0? -(unsigned)c : (unsigned)c, c < 0, s);
+}
+
 static inline int kputuw(unsigned c, kstring_t *s)
 {
-	char buf[16];
-	int l, i;
-	unsigned x;
-	if (c == 0) return kputc('0', s);
-	for (l = 0, x = c; x > 0; x /= 10) buf[l++] = x%10 + '0';
-	if (s->l + l + 1 >= s->m) {
-		char *tmp;
-		s->m = s->l + l + 2;
-		kroundup32(s->m);
-		if ((tmp = (char*)realloc(s->s, s->m)))
-			s->s = tmp;
-		else
-			return EOF;
-	}
-	for (i = l - 1; i >= 0; --i) s->s[s->l++] = buf[i];
-	s->s[s->l] = 0;
-	return 0;
+	return kputu64_(c, 0, s);
 }
 
 static inline int kputl(long c, kstring_t *s)
 {
-	char buf[32];
-	int i, l = 0;
-	unsigned long x = c;
-	if (c < 0) x = -x;
-	do { buf[l++] = x%10 + '0'; x /= 10; } while (x > 0);
-	if (c < 0) buf[l++] = '-';
-	if (s->l + l + 1 >= s->m) {
-		char *tmp;
-		s->m = s->l + l + 2;
-		kroundup32(s->m);
-		if ((tmp = (char*)realloc(s->s, s->m)))
-			s->s = tmp;
-		else
-			return EOF;
+	return kputu64_(c < 0? -(unsigned long)c : (unsigned long)c, c < 0, s);
+}
+
+/* kstrtol() is similar to strtol(str, end, 10) but parses at most l bytes
+ * from str, which needs not be null terminated. On overflow, it returns
+ * LONG_MAX or LONG_MIN, as strtol() does, without setting errno. */
+static inline long kstrtol(const char *str, int l, const char **end)
+{
+	const char *p = str, *e = str + l, *q;
+	unsigned long x = 0, max;
+	int neg = 0, over = 0;
+	while (p < e && (*p == ' ' || (unsigned char)(*p - 9) <= 4)) ++p; // isspace()
+	if (p < e && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+	max = neg? -(unsigned long)LONG_MIN : LONG_MAX;
+	for (q = p; p < e && *p >= '0' && *p <= '9'; ++p) {
+		unsigned d = *p - '0';
+		if (x > (max - d) / 10) over = 1;
+		else x = x * 10 + d;
 	}
-	for (i = l - 1; i >= 0; --i) s->s[s->l++] = buf[i];
-	s->s[s->l] = 0;
-	return 0;
+	if (p == q) p = str; // no digits
+	if (end) *end = p;
+	if (over) return neg? LONG_MIN : LONG_MAX;
+	return neg? (long)(0UL - x) : (long)x;
 }
 
 /*
@@ -1,6 +1,151 @@
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#endif
+#include <stdio.h>
 #include <pthread.h>
+#include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <limits.h>
+#include <time.h>
+#include "kthread.h"
+
+/*******************
+ * Thread placement *
+ *******************/
+
+#ifdef __linux__
+typedef struct {
+	int n_cpu, n_node;
+	int *cpu;      // allowed CPUs, sorted by NUMA node and then by CPU ID
+	int *node_off; // CPUs on node i are cpu[node_off[i]..node_off[i+1]-1]
+} kt_topo_t;
+
+static kt_topo_t kt_topo;
+static pthread_once_t kt_topo_once = PTHREAD_ONCE_INIT;
+
+static int kt_parse_cpulist(const char *fn, const cpu_set_t *allowed, int *cpu, int n) // parse a list like "0-3,8-11"; keep all if allowed==NULL
+{
+	FILE *fp;
+	int a, b, c;
+	if ((fp = fopen(fn, "r")) == 0) return n;
+	while (fscanf(fp, "%d", &a) == 1) {
+		b = a;
+		if ((c = fgetc(fp)) == '-') {
+			if (fscanf(fp, "%d", &b) != 1) break;
+			c = fgetc(fp);
+		}
+		for (; a <= b; ++a)
+			if (a < CPU_SETSIZE && (allowed == 0 || CPU_ISSET(a, allowed))) cpu[n++] = a;
+		if (c != ',') break;
+	}
+	fclose(fp);
+	return n;
+}
+
+static void kt_topo_init(void)
+{
+	kt_topo_t *t = &kt_topo;
+	cpu_set_t allowed;
+	char fn[64];
+	int i, n_alloc, n_online, *online;
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) return;
+	n_alloc = CPU_COUNT(&allowed);
+	t->cpu = (int*)malloc(n_alloc * sizeof(int));
+	t->node_off = (int*)malloc((n_alloc + 1) * sizeof(int));
+	online = (int*)malloc(CPU_SETSIZE * sizeof(int));
+	n_online = kt_parse_cpulist("/sys/devices/system/node/online", 0, online, 0); // 0 if there is no NUMA information
+	for (i = 0; i < n_online && t->n_node < n_alloc; ++i) { // NUMA nodes with no allowed CPUs are skipped
+		int n0 = t->n_cpu;
+		snprintf(fn, 64, "/sys/devices/system/node/node%d/cpulist", online[i]);
+		t->n_cpu = kt_parse_cpulist(fn, &allowed, t->cpu, t->n_cpu);
+		if (t->n_cpu > n0) t->node_off[t->n_node++] = n0;
+		if (t->n_cpu == n_alloc) break;
+	}
+	free(online);
+	if (t->n_cpu != n_alloc) { // no NUMA information; treat the machine as one node
+		for (i = t->n_cpu = 0; i < CPU_SETSIZE; ++i)
+			if (CPU_ISSET(i, &allowed)) t->cpu[t->n_cpu++] = i;
+		t->n_node = 1, t->node_off[0] = 0;
+	}
+	t->node_off[t->n_node] = t->n_cpu;
+}
+
+static void kt_set_affinity(int aff, int slot, int n_slots) // place the calling thread
+{
+	kt_topo_t *t = &kt_topo;
+	cpu_set_t set;
+	int i;
+	if (aff == KT_AFF_NONE || n_slots <= 0) return;
+	pthread_once(&kt_topo_once, kt_topo_init);
+	if (t->n_cpu == 0) return;
+	CPU_ZERO(&set);
+	if (aff == KT_AFF_CPU) {
+		CPU_SET(t->cpu[slot % t->n_cpu], &set);
+	} else {
+		int node = (long)slot * t->n_node / n_slots % t->n_node;
+		for (i = t->node_off[node]; i < t->node_off[node+1]; ++i)
+			CPU_SET(t->cpu[i], &set);
+	}
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
+#else
+static void kt_set_affinity(int aff, int slot, int n_slots) {}
+#endif
+
+/*******************
+ * Instrumentation *
+ *******************/
+
+static inline double kt_realtime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void kt_stats_reserve(kt_stats_t *st, int n_workers, int n_steps) // enlarge arrays; new elements are zeroed
+{
+	if (n_workers > st->n_workers) {
+		st->w = (kt_wstat_t*)realloc(st->w, n_workers * sizeof(kt_wstat_t));
+		memset(st->w + st->n_workers, 0, (n_workers - st->n_workers) * sizeof(kt_wstat_t));
+		st->n_workers = n_workers;
+	}
+	if (n_steps > st->n_steps) {
+		st->s = (kt_sstat_t*)realloc(st->s, n_steps * sizeof(kt_sstat_t));
+		memset(st->s + st->n_steps, 0, (n_steps - st->n_steps) * sizeof(kt_sstat_t));
+		st->n_steps = n_steps;
+	}
+}
+
+void kt_stats_destroy(kt_stats_t *st)
+{
+	if (st == 0) return;
+	free(st->w); free(st->s);
+	memset(st, 0, sizeof(kt_stats_t));
+}
+
+void kt_stats_print(const kt_stats_t *st)
+{
+	int i;
+	double busy = 0.;
+	for (i = 0; i < st->n_workers; ++i) busy += st->w[i].t_busy;
+	fprintf(stderr, "[kt_stats] n_calls=%ld, wall=%.3f sec, busy=%.3f CPU sec\n", (long)st->n_calls, st->t_wall, busy);
+	for (i = 0; i < st->n_workers; ++i) {
+		const kt_wstat_t *w = &st->w[i];
+		fprintf(stderr, "[kt_stats] worker %d: items=%ld, steals=%ld, busy=%.3f sec (%.1f%%), wait=%.3f sec\n", i,
+				(long)w->n_items, (long)w->n_steals, w->t_busy, st->t_wall > 0.? 100. * w->t_busy / st->t_wall : 0., w->t_wait);
+	}
+	for (i = 0; i < st->n_steps; ++i) {
+		const kt_sstat_t *s = &st->s[i];
+		fprintf(stderr, "[kt_stats] step %d: batches=%ld, work=%.3f sec, queue_wait=%.3f sec\n", i,
+				(long)s->n_batches, s->t_work, s->t_qwait);
+	}
+}
 
 /************
  * kt_for() *
@@ -73,12 +218,20 @@ struct kt_forpool_t;
 typedef struct {
 	struct kt_forpool_t *t;
 	long i;
-	int action;
 } kto_worker_t;
 
+/* Workers and the master hand over through two counters: the master bumps
+ * _gen_ to dispatch a loop and workers decrement _n_pending_ on completion.
+ * Either side spins for at most _spin_ rounds on the counter before falling
+ * back to the condition variable. _n_sleep_ and _m_sleep_ tell the other side
+ * whether a signal is needed. */
 typedef struct kt_forpool_t {
-	int n_threads, n_pending;
+	int n_threads, spin;
+	volatile int n_pending, gen, stop, n_sleep, m_sleep;
+	int aff, slot0, n_slots; // thread placement; worker i is placed at slot slot0+i out of n_slots
+	int no_steal;
 	long n;
+	kt_stats_t *st; // NULL if instrumentation is disabled
 	pthread_t *tid;
 	kto_worker_t *w;
 	void (*func)(void*,long,int);
@@ -87,12 +240,23 @@ typedef struct kt_forpool_t {
 	pthread_cond_t cv_m, cv_s;
 } kt_forpool_t;
 
+#define kt_load(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+
+static inline void kt_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
 static inline long kt_fp_steal_work(kt_forpool_t *t)
 {
 	int i, min_i = -1;
 	long k, min = LONG_MAX;
 	for (i = 0; i < t->n_threads; ++i)
-		if (min > t->w[i].i) min = t->w[i].i, min_i = i;
+		if (min > kt_load(t->w[i].i)) min = kt_load(t->w[i].i), min_i = i;
 	k = __sync_fetch_and_add(&t->w[min_i].i, t->n_threads);
 	return k >= t->n? -1 : k;
 }
@@ -101,34 +265,77 @@ static void *kt_fp_worker(void *data)
 {
 	kto_worker_t *w = (kto_worker_t*)data;
 	kt_forpool_t *fp = w->t;
+	int k, gen = 0, tid = w - fp->w;
+	kt_set_affinity(fp->aff, fp->slot0 + tid, fp->n_slots);
 	for (;;) {
-		long i;
-		int action;
-		pthread_mutex_lock(&fp->mutex);
-		if (--fp->n_pending == 0)
+		long i, n_items = 0, n_steals = 0;
+		double t0 = kt_load(fp->st)? kt_realtime() : 0., t1 = 0.;
+		if (__sync_sub_and_fetch(&fp->n_pending, 1) == 0 && kt_load(fp->m_sleep)) { // the master is waiting on cv_m
+			pthread_mutex_lock(&fp->mutex);
 			pthread_cond_signal(&fp->cv_m);
-		w->action = 0;
-		while (w->action == 0) pthread_cond_wait(&fp->cv_s, &fp->mutex);
-		action = w->action;
-		pthread_mutex_unlock(&fp->mutex);
-		if (action < 0) break;
+			pthread_mutex_unlock(&fp->mutex);
+		}
+		for (k = 0; k < fp->spin && kt_load(fp->gen) == gen; ++k) kt_cpu_relax();
+		if (kt_load(fp->gen) == gen) {
+			pthread_mutex_lock(&fp->mutex);
+			__sync_fetch_and_add(&fp->n_sleep, 1);
+			while (kt_load(fp->gen) == gen) pthread_cond_wait(&fp->cv_s, &fp->mutex);
+			__sync_fetch_and_sub(&fp->n_sleep, 1);
+			pthread_mutex_unlock(&fp->mutex);
+		}
+		gen = kt_load(fp->gen);
+		if (fp->stop) break;
+		if (fp->st) {
+			t1 = kt_realtime();
+			if (t0 > 0.) fp->st->w[tid].t_wait += t1 - t0;
+		}
 		for (;;) { // process jobs allocated to this worker
 			i = __sync_fetch_and_add(&w->i, fp->n_threads);
 			if (i >= fp->n) break;
-			fp->func(fp->data, i, w - fp->w);
+			fp->func(fp->data, i, tid);
+			++n_items;
+		}
+		if (!fp->no_steal) {
+			while ((i = kt_fp_steal_work(fp)) >= 0) // steal jobs allocated to other workers
+				fp->func(fp->data, i, tid), ++n_steals;
+		}
+		if (fp->st) {
+			kt_wstat_t *ws = &fp->st->w[tid];
+			ws->n_items += n_items + n_steals, ws->n_steals += n_steals;
+			ws->t_busy += kt_realtime() - t1;
 		}
-		while ((i = kt_fp_steal_work(fp)) >= 0) // steal jobs allocated to other workers
-			fp->func(fp->data, i, w - fp->w);
 	}
 	pthread_exit(0);
 }
 
-void *kt_forpool_init(int n_threads)
+static void kt_fp_dispatch(kt_forpool_t *fp) // wake up workers and wait for them to finish
+{
+	int k;
+	__atomic_store_n(&fp->n_pending, fp->n_threads, __ATOMIC_RELAXED); // published by the full barrier below
+	__sync_fetch_and_add(&fp->gen, 1);
+	if (kt_load(fp->n_sleep)) {
+		pthread_mutex_lock(&fp->mutex);
+		pthread_cond_broadcast(&fp->cv_s);
+		pthread_mutex_unlock(&fp->mutex);
+	}
+	for (k = 0; k < fp->spin && kt_load(fp->n_pending); ++k) kt_cpu_relax();
+	if (kt_load(fp->n_pending)) {
+		pthread_mutex_lock(&fp->mutex);
+		__sync_fetch_and_add(&fp->m_sleep, 1);
+		while (kt_load(fp->n_pending)) pthread_cond_wait(&fp->cv_m, &fp->mutex);
+		__atomic_store_n(&fp->m_sleep, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&fp->mutex);
+	}
+}
+
+static void *kt_forpool_init_core(int n_threads, int aff, int slot0, int n_slots)
 {
 	kt_forpool_t *fp;
 	int i;
 	fp = (kt_forpool_t*)calloc(1, sizeof(kt_forpool_t));
 	fp->n_threads = fp->n_pending = n_threads;
+	fp->spin = n_threads < sysconf(_SC_NPROCESSORS_ONLN)? KT_SPIN_DEFAULT : 0; // spinning hurts when CPUs are oversubscribed
+	fp->aff = aff, fp->slot0 = slot0, fp->n_slots = n_slots;
 	fp->tid = (pthread_t*)calloc(fp->n_threads, sizeof(pthread_t));
 	fp->w = (kto_worker_t*)calloc(fp->n_threads, sizeof(kto_worker_t));
 	for (i = 0; i < fp->n_threads; ++i) fp->w[i].t = fp;
@@ -137,17 +344,46 @@ void *kt_forpool_init(int n_threads)
 	pthread_cond_init(&fp->cv_s, 0);
 	for (i = 0; i < fp->n_threads; ++i) pthread_create(&fp->tid[i], 0, kt_fp_worker, &fp->w[i]);
 	pthread_mutex_lock(&fp->mutex);
-	while (fp->n_pending) pthread_cond_wait(&fp->cv_m, &fp->mutex);
+	__sync_fetch_and_add(&fp->m_sleep, 1);
+	while (kt_load(fp->n_pending)) pthread_cond_wait(&fp->cv_m, &fp->mutex);
+	__atomic_store_n(&fp->m_sleep, 0, __ATOMIC_RELAXED);
 	pthread_mutex_unlock(&fp->mutex);
 	return fp;
 }
 
+void *kt_forpool_init2(int n_threads, int aff)
+{
+	return kt_forpool_init_core(n_threads, aff, 0, n_threads);
+}
+
+void *kt_forpool_init(int n_threads)
+{
+	return kt_forpool_init_core(n_threads, KT_AFF_NONE, 0, n_threads);
+}
+
+void kt_forpool_set_spin(void *_fp, int spin)
+{
+	kt_forpool_t *fp = (kt_forpool_t*)_fp;
+	if (fp) fp->spin = spin > 0? spin : 0;
+}
+
+void kt_forpool_set_stats(void *_fp, kt_stats_t *st)
+{
+	kt_forpool_t *fp = (kt_forpool_t*)_fp;
+	if (fp == 0) return;
+	if (st) kt_stats_reserve(st, fp->n_threads, 0);
+	__atomic_store_n(&fp->st, st, __ATOMIC_RELEASE);
+}
+
 void kt_forpool_destroy(void *_fp)
 {
 	kt_forpool_t *fp = (kt_forpool_t*)_fp;
 	int i;
-	for (i = 0; i < fp->n_threads; ++i) fp->w[i].action = -1;
+	fp->stop = 1;
+	pthread_mutex_lock(&fp->mutex);
+	__sync_fetch_and_add(&fp->gen, 1);
 	pthread_cond_broadcast(&fp->cv_s);
+	pthread_mutex_unlock(&fp->mutex);
 	for (i = 0; i < fp->n_threads; ++i) pthread_join(fp->tid[i], 0);
 	pthread_cond_destroy(&fp->cv_s);
 	pthread_cond_destroy(&fp->cv_m);
@@ -160,15 +396,130 @@ void kt_forpool(void *_fp, void (*func)(void*,long,int), void *data, long n)
 	kt_forpool_t *fp = (kt_forpool_t*)_fp;
 	long i;
 	if (fp && fp->n_threads > 1) {
-		fp->n = n, fp->func = func, fp->data = data, fp->n_pending = fp->n_threads;
-		for (i = 0; i < fp->n_threads; ++i) fp->w[i].i = i, fp->w[i].action = 1;
-		pthread_mutex_lock(&fp->mutex);
-		pthread_cond_broadcast(&fp->cv_s);
-		while (fp->n_pending) pthread_cond_wait(&fp->cv_m, &fp->mutex);
-		pthread_mutex_unlock(&fp->mutex);
+		double t = fp->st? kt_realtime() : 0.;
+		fp->n = n, fp->func = func, fp->data = data;
+		for (i = 0; i < fp->n_threads; ++i) fp->w[i].i = i;
+		kt_fp_dispatch(fp);
+		if (fp->st) fp->st->t_wall += kt_realtime() - t, ++fp->st->n_calls;
 	} else for (i = 0; i < n; ++i) func(data, i, 0);
 }
 
+typedef struct {
+	uint8_t *buf;
+	size_t size, block;
+} kt_touch_t;
+
+static void kt_touch_worker(void *data, long i, int tid)
+{
+	kt_touch_t *t = (kt_touch_t*)data;
+	size_t st = (size_t)i * t->block;
+	memset(t->buf + st, 0, st + t->block < t->size? t->block : t->size - st);
+}
+
+void kt_forpool_touch(void *_fp, void *buf, size_t size, size_t block)
+{
+	kt_forpool_t *fp = (kt_forpool_t*)_fp;
+	kt_touch_t t;
+	if (block == 0) block = 1;
+	t.buf = (uint8_t*)buf, t.size = size, t.block = block;
+	if (fp) fp->no_steal = 1; // so that block i is always touched by worker i%n_threads
+	kt_forpool(fp, kt_touch_worker, &t, (size + block - 1) / block);
+	if (fp) fp->no_steal = 0;
+}
+
+/*******************************
+ * Parallel reduction and scan *
+ *******************************/
+
+typedef struct {
+	long n, chunk;
+	size_t size; // size of a partial result, rounded up to a cache line
+	uint8_t *acc; // partial results, one per worker
+	int stride;
+	void (*func)(void*,long,long,void*);
+	void (*combine)(void*,void*,const void*);
+	void *data;
+} kt_reduce_t;
+
+static void kt_reduce_worker(void *data, long i, int tid)
+{
+	kt_reduce_t *r = (kt_reduce_t*)data;
+	long st = i * r->chunk, en = st + r->chunk < r->n? st + r->chunk : r->n;
+	r->func(r->data, st, en, r->acc + tid * r->size);
+}
+
+static void kt_reduce_merge(void *data, long i, int tid) // merge partial i*2*stride+stride into i*2*stride
+{
+	kt_reduce_t *r = (kt_reduce_t*)data;
+	long k = i * 2 * r->stride;
+	r->combine(r->data, r->acc + k * r->size, r->acc + (k + r->stride) * r->size);
+}
+
+void kt_reduce(void *_fp, void (*func)(void*,long,long,void*), void (*init)(void*,void*), void (*combine)(void*,void*,const void*), void *data, long n, long chunk, size_t size, void *out)
+{
+	kt_forpool_t *fp = (kt_forpool_t*)_fp;
+	int i, n_acc = fp && fp->n_threads > 1? fp->n_threads : 1;
+	kt_reduce_t r;
+	r.n = n, r.func = func, r.combine = combine, r.data = data;
+	r.chunk = chunk > 0? chunk : n / (n_acc * 8) > 0? n / (n_acc * 8) : 1;
+	r.size = (size + 63) / 64 * 64; // avoid false sharing between workers
+	r.acc = (uint8_t*)malloc(r.size * n_acc);
+	for (i = 0; i < n_acc; ++i) init(data, r.acc + i * r.size);
+	kt_forpool(fp, kt_reduce_worker, &r, (n + r.chunk - 1) / r.chunk);
+	for (r.stride = 1; r.stride < n_acc; r.stride <<= 1) // merge in a tree
+		kt_forpool(fp, kt_reduce_merge, &r, (n_acc - r.stride + 2 * r.stride - 1) / (2 * r.stride));
+	memcpy(out, r.acc, size);
+	free(r.acc);
+}
+
+typedef struct {
+	long n, chunk;
+	const int64_t *in;
+	int64_t *out, *sum; // sum[i] is the sum of block i
+	int inclusive;
+} kt_scan_t;
+
+static void kt_scan_sum(void *data, long i, int tid)
+{
+	kt_scan_t *s = (kt_scan_t*)data;
+	long j, st = i * s->chunk, en = st + s->chunk < s->n? st + s->chunk : s->n;
+	int64_t x = 0;
+	for (j = st; j < en; ++j) x += s->in[j];
+	s->sum[i] = x;
+}
+
+static void kt_scan_block(void *data, long i, int tid)
+{
+	kt_scan_t *s = (kt_scan_t*)data;
+	long j, st = i * s->chunk, en = st + s->chunk < s->n? st + s->chunk : s->n;
+	int64_t x = s->sum[i], y;
+	if (s->inclusive) {
+		for (j = st; j < en; ++j) x += s->in[j], s->out[j] = x;
+	} else {
+		for (j = st; j < en; ++j) y = s->in[j], s->out[j] = x, x += y;
+	}
+}
+
+int64_t kt_scan(void *_fp, const int64_t *in, int64_t *out, long n, int inclusive)
+{
+	kt_forpool_t *fp = (kt_forpool_t*)_fp;
+	int n_threads = fp && fp->n_threads > 1? fp->n_threads : 1;
+	long i, n_blk;
+	int64_t x, y;
+	kt_scan_t s;
+	s.n = n, s.in = in, s.out = out, s.inclusive = !!inclusive;
+	s.chunk = n / (n_threads * 4);
+	if (s.chunk < 4096) s.chunk = 4096; // too small blocks are not worth parallelizing
+	n_blk = (n + s.chunk - 1) / s.chunk;
+	s.sum = (int64_t*)malloc((n_blk + 1) * sizeof(int64_t));
+	kt_forpool(fp, kt_scan_sum, &s, n_blk);
+	for (i = 0, x = 0; i < n_blk; ++i) // exclusive scan over block sums
+		y = s.sum[i], s.sum[i] = x, x += y;
+	kt_forpool(fp, kt_scan_block, &s, n_blk);
+	free(s.sum);
+	return x;
+}
+
 /*****************
  * kt_pipeline() *
  *****************/
@@ -178,45 +529,82 @@ struct ktp_t;
 typedef struct {
 	struct ktp_t *pl;
 	int64_t index;
-	int step;
+	int step, slot;
 	void *data;
 } ktp_worker_t;
 
+typedef struct {
+	int max_batches, n_running;
+	int n_threads; // number of threads in each inner forpool
+	uint32_t busy; // which inner forpools are in use
+	void **fp; // inner forpools; one per concurrent batch
+} ktp_step_aux_t;
+
 typedef struct ktp_t {
 	void *shared;
 	void *(*func)(void*, int, void*);
+	void *(*func2)(void*, int, void*, void*);
 	int64_t index;
 	int n_workers, n_steps;
+	int aff, n_slots;
+	kt_stats_t *st; // NULL if instrumentation is disabled
 	ktp_worker_t *workers;
+	ktp_step_aux_t *steps;
 	pthread_mutex_t mutex;
 	pthread_cond_t cv;
 } ktp_t;
 
+static inline int ktp_can_start(const ktp_t *p, const ktp_worker_t *w)
+{
+	const ktp_step_aux_t *s = &p->steps[w->step];
+	int i;
+	if (s->n_running >= s->max_batches) return 0;
+	for (i = 0; i < p->n_workers; ++i) {
+		const ktp_worker_t *v = &p->workers[i];
+		if (v == w || v->index >= w->index) continue;
+		if (v->step < w->step) return 0; // a previous batch has not entered w->step yet
+		if (v->step == w->step && s->max_batches == 1) return 0; // serial step: keep batches in order
+	}
+	return 1;
+}
+
 static void *ktp_worker(void *data)
 {
 	ktp_worker_t *w = (ktp_worker_t*)data;
 	ktp_t *p = w->pl;
+	int tid = w - p->workers;
+	kt_set_affinity(p->aff, tid, p->n_slots);
 	while (w->step < p->n_steps) {
+		ktp_step_aux_t *s = &p->steps[w->step];
+		void *fp = 0;
+		double t0 = p->st? kt_realtime() : 0., t1 = 0.;
 		// test whether we can kick off the job with this worker
 		pthread_mutex_lock(&p->mutex);
-		for (;;) {
-			int i;
-			// test whether another worker is doing the same step
-			for (i = 0; i < p->n_workers; ++i) {
-				if (w == &p->workers[i]) continue; // ignore itself
-				if (p->workers[i].step <= w->step && p->workers[i].index < w->index)
-					break;
-			}
-			if (i == p->n_workers) break; // no workers with smaller indices are doing w->step or the previous steps
+		while (!ktp_can_start(p, w))
 			pthread_cond_wait(&p->cv, &p->mutex);
+		if (p->st) t1 = kt_realtime();
+		++s->n_running;
+		if (s->fp) { // take an idle inner forpool
+			for (w->slot = 0; s->busy>>w->slot&1; ++w->slot);
+			s->busy |= 1U<<w->slot, fp = s->fp[w->slot];
 		}
 		pthread_mutex_unlock(&p->mutex);
 
-		// working on w->step
-		w->data = p->func(p->shared, w->step, w->step? w->data : 0); // for the first step, input is NULL
+		// working on w->step; for the first step, input is NULL
+		if (p->func2) w->data = p->func2(p->shared, w->step, w->step? w->data : 0, fp);
+		else w->data = p->func(p->shared, w->step, w->step? w->data : 0);
 
 		// update step and let other workers know
 		pthread_mutex_lock(&p->mutex);
+		if (p->st) {
+			kt_sstat_t *ss = &p->st->s[w->step];
+			kt_wstat_t *ws = &p->st->w[tid];
+			double t2 = kt_realtime();
+			++ss->n_batches, ss->t_work += t2 - t1, ss->t_qwait += t1 - t0;
+			++ws->n_items, ws->t_busy += t2 - t1, ws->t_wait += t1 - t0;
+		}
+		--s->n_running;
+		if (s->fp) s->busy &= ~(1U<<w->slot);
 		w->step = w->step == p->n_steps - 1 || w->data? (w->step + 1) % p->n_steps : p->n_steps;
 		if (w->step == 0) w->index = p->index++;
 		pthread_cond_broadcast(&p->cv);
@@ -225,32 +613,75 @@ static void *ktp_worker(void *data)
 	pthread_exit(0);
 }
 
-void kt_pipeline(int n_threads, void *(*func)(void*, int, void*), void *shared_data, int n_steps)
+static void kt_pipeline_core(ktp_t *aux, int n_threads, void *shared_data, int n_steps, const ktp_step_t *steps, int aff, kt_stats_t *st)
 {
-	ktp_t aux;
 	pthread_t *tid;
-	int i;
+	int i, j, slot;
+	double t_start = st? kt_realtime() : 0.;
 
 	if (n_threads < 1) n_threads = 1;
-	aux.n_workers = n_threads;
-	aux.n_steps = n_steps;
-	aux.func = func;
-	aux.shared = shared_data;
-	aux.index = 0;
-	pthread_mutex_init(&aux.mutex, 0);
-	pthread_cond_init(&aux.cv, 0);
-
-	aux.workers = (ktp_worker_t*)alloca(n_threads * sizeof(ktp_worker_t));
+	aux->n_workers = n_threads;
+	aux->n_steps = n_steps;
+	aux->shared = shared_data;
+	aux->index = 0;
+	aux->aff = aff;
+	aux->st = st;
+	if (st) kt_stats_reserve(st, n_threads, n_steps);
+	pthread_mutex_init(&aux->mutex, 0);
+	pthread_cond_init(&aux->cv, 0);
+
+	aux->steps = (ktp_step_aux_t*)calloc(n_steps, sizeof(ktp_step_aux_t));
+	aux->n_slots = n_threads; // pipeline workers take the first n_threads placement slots
+	for (i = 0; i < n_steps; ++i) {
+		ktp_step_aux_t *s = &aux->steps[i];
+		s->max_batches = steps && steps[i].max_batches > 1? steps[i].max_batches : 1;
+		if (s->max_batches > n_threads) s->max_batches = n_threads;
+		if (s->max_batches > 32) s->max_batches = 32; // limited by ktp_step_aux_t::busy
+		s->n_threads = steps? steps[i].n_threads : 0;
+		if (s->n_threads > 1) aux->n_slots += s->max_batches * s->n_threads;
+	}
+	for (i = 0, slot = n_threads; i < n_steps; ++i) { // inner forpools take the following slots
+		ktp_step_aux_t *s = &aux->steps[i];
+		if (s->n_threads <= 1) continue;
+		s->fp = (void**)calloc(s->max_batches, sizeof(void*));
+		for (j = 0; j < s->max_batches; ++j, slot += s->n_threads)
+			s->fp[j] = kt_forpool_init_core(s->n_threads, aff, slot, aux->n_slots);
+	}
+
+	aux->workers = (ktp_worker_t*)alloca(n_threads * sizeof(ktp_worker_t));
 	for (i = 0; i < n_threads; ++i) {
-		ktp_worker_t *w = &aux.workers[i];
-		w->step = 0; w->pl = &aux; w->data = 0;
-		w->index = aux.index++;
+		ktp_worker_t *w = &aux->workers[i];
+		w->step = 0; w->pl = aux; w->data = 0; w->slot = 0;
+		w->index = aux->index++;
 	}
 
 	tid = (pthread_t*)alloca(n_threads * sizeof(pthread_t));
-	for (i = 0; i < n_threads; ++i) pthread_create(&tid[i], 0, ktp_worker, &aux.workers[i]);
+	for (i = 0; i < n_threads; ++i) pthread_create(&tid[i], 0, ktp_worker, &aux->workers[i]);
 	for (i = 0; i < n_threads; ++i) pthread_join(tid[i], 0);
 
-	pthread_mutex_destroy(&aux.mutex);
-	pthread_cond_destroy(&aux.cv);
+	for (i = 0; i < n_steps; ++i) {
+		ktp_step_aux_t *s = &aux->steps[i];
+		if (s->fp == 0) continue;
+		for (j = 0; j < s->max_batches; ++j)
+			kt_forpool_destroy(s->fp[j]);
+		free(s->fp);
+	}
+	free(aux->steps);
+	if (st) st->t_wall += kt_realtime() - t_start, ++st->n_calls;
+	pthread_mutex_destroy(&aux->mutex);
+	pthread_cond_destroy(&aux->cv);
+}
+
+void kt_pipeline(int n_threads, void *(*func)(void*, int, void*), void *shared_data, int n_steps)
+{
+	ktp_t aux;
+	aux.func = func, aux.func2 = 0;
+	kt_pipeline_core(&aux, n_threads, shared_data, n_steps, 0, KT_AFF_NONE, 0);
+}
+
+void kt_pipeline2(int n_threads, void *(*func)(void*, int, void*, void*), void *shared_data, int n_steps, const ktp_step_t *steps, int aff, kt_stats_t *st)
+{
+	ktp_t aux;
+	aux.func = 0, aux.func2 = func;
+	kt_pipeline_core(&aux, n_threads, shared_data, n_steps, steps, aff, st);
 }
@@ -1,6 +1,37 @@
 #ifndef KTHREAD_H
 #define KTHREAD_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define KT_AFF_NONE 0 // default OS scheduling
+#define KT_AFF_CPU  1 // pin each worker to one CPU; consecutive workers share a NUMA node
+#define KT_AFF_NODE 2 // bind each worker to the CPUs of one NUMA node; workers are spread evenly over nodes
+
+#define KT_SPIN_DEFAULT 2000 // default number of busy-wait rounds before a kt_forpool thread sleeps, if there are spare CPUs
+
+typedef struct {
+	int64_t n_items, n_steals; // for kt_pipeline, n_items is the number of steps run and n_steals is 0
+	double t_busy, t_wait;     // time (in sec) spent in the callback and waiting to be woken up or to start a step
+} kt_wstat_t;
+
+typedef struct {
+	int64_t n_batches;
+	double t_work, t_qwait; // time spent in the callback and waiting for the step to become available
+} kt_sstat_t;
+
+/* Thread-pool statistics. Initialize with {0}; statistics accumulate over
+ * calls until kt_stats_destroy(), which frees the arrays. Only kt_forpool()
+ * (via kt_forpool_set_stats()) and kt_pipeline2() are instrumented; kt_for()
+ * and kt_pipeline() keep their original interfaces and collect nothing. */
+typedef struct {
+	int n_workers, n_steps;
+	int64_t n_calls;
+	double t_wall; // total wall-clock time of kt_forpool() or kt_pipeline2() calls
+	kt_wstat_t *w; // per-worker statistics
+	kt_sstat_t *s; // per-step statistics; kt_pipeline2() only
+} kt_stats_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -9,9 +40,54 @@ void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
 void kt_pipeline(int n_threads, void *(*func)(void*, int, void*), void *shared_data, int n_steps);
 
 void *kt_forpool_init(int n_threads);
+void *kt_forpool_init2(int n_threads, int aff); // aff is one of KT_AFF_*; no effect on non-Linux systems
 void kt_forpool_destroy(void *_fp);
 void kt_forpool(void *_fp, void (*func)(void*,long,int), void *data, long n);
 
+/* Idle workers and the calling thread of kt_forpool() busy-wait for _spin_
+ * rounds before blocking on a condition variable. A larger value lowers the
+ * latency of frequent small loops at the cost of CPU time; 0 always blocks. */
+void kt_forpool_set_spin(void *_fp, int spin);
+
+// enable (st!=NULL) or disable (st==NULL) instrumentation of subsequent kt_forpool() calls
+void kt_forpool_set_stats(void *_fp, kt_stats_t *st);
+
+void kt_stats_destroy(kt_stats_t *st);
+void kt_stats_print(const kt_stats_t *st);
+
+/* kt_forpool_touch() zeroes _buf_ in blocks of _block_ bytes, with block i
+ * written by worker i%n_threads, the worker that first gets item i in
+ * kt_forpool(). Under the first-touch policy, pages land on the NUMA node of
+ * that worker. _block_ should be a multiple of the page size. */
+void kt_forpool_touch(void *_fp, void *buf, size_t size, size_t block);
+
+/* kt_reduce() splits [0,n) into chunks of _chunk_ items (automatic if <=0)
+ * and calls _func_(data,st,en,acc) on each chunk, where _acc_ is the partial
+ * result of the current worker, _size_ bytes in size and initialized by
+ * _init_(data,acc). Partial results are merged pairwise in a tree with
+ * _combine_(data,dst,src) and the final result is copied to _out_. */
+void kt_reduce(void *_fp, void (*func)(void*,long,long,void*), void (*init)(void*,void*), void (*combine)(void*,void*,const void*), void *data, long n, long chunk, size_t size, void *out);
+
+/* kt_scan() computes the prefix sums of in[0..n-1] into out[], which may be
+ * the same array as in[]. out[i] includes in[i] if _inclusive_ is true, and
+ * excludes it otherwise. It returns the total sum. */
+int64_t kt_scan(void *_fp, const int64_t *in, int64_t *out, long n, int inclusive);
+
+typedef struct {
+	int max_batches; // max number of batches processed concurrently at this step; <=1 for a serial step
+	int n_threads;   // if >1, the step is given an inner kt_forpool of this many threads
+} ktp_step_t;
+
+/* kt_pipeline2() is similar to kt_pipeline() except that each step can be
+ * configured with _steps_, which may be NULL. A serial step processes batches
+ * one at a time in the input order; a parallel step may process up to
+ * max_batches batches concurrently. The last argument of _func_ is the inner
+ * kt_forpool for the step, or NULL if ktp_step_t::n_threads<=1. It is always
+ * safe to call kt_forpool() on it. Pipeline workers and inner kt_forpool
+ * threads are placed according to _aff_ (one of KT_AFF_*). If _st_ is not
+ * NULL, per-worker and per-step statistics are accumulated to it. */
+void kt_pipeline2(int n_threads, void *(*func)(void*, int, void*, void*), void *shared_data, int n_steps, const ktp_step_t *steps, int aff, kt_stats_t *st);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "kwriter.h"
+
+#define KW_DEF_HWM 0x10000
+#define KW_MAX_IOV 64
+
+typedef struct kw_flusher_s {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_work, cv_main;
+	int n_buf, n_busy; // n_busy: buffers queued or being written
+	int n_pend, n_spare, stop;
+	kstring_t *pend, *spare;
+	kstring_t *buf; // buffers being written; used by the flusher thread only
+	struct iovec *iov;
+} kw_flusher_t;
+
+static kwriter_t *kw_init(size_t hwm)
+{
+	kwriter_t *w;
+	w = (kwriter_t*)calloc(1, sizeof(kwriter_t));
+	if (w == 0) return 0;
+	w->fd = -1;
+	w->hwm = hwm? hwm : KW_DEF_HWM;
+	return w;
+}
+
+kwriter_t *kw_init_fd(int fd, size_t hwm)
+{
+	kwriter_t *w = kw_init(hwm);
+	if (w) w->fd = fd;
+	return w;
+}
+
+kwriter_t *kw_init_fp(FILE *fp, size_t hwm)
+{
+	kwriter_t *w = kw_init(hwm);
+	if (w) w->fp = fp;
+	return w;
+}
+
+kwriter_t *kw_init_func(void *fp, kw_write_f *func, size_t hwm)
+{
+	kwriter_t *w = kw_init(hwm);
+	if (w) w->func_fp = fp, w->func = func;
+	return w;
+}
+
+/***************
+ * Writing out *
+ ***************/
+
+static int kw_writev_fd(int fd, struct iovec *iov, int n) // write all of iov[0..n), resuming after partial writes
+{
+	while (n > 0) {
+		ssize_t r = writev(fd, iov, n < KW_MAX_IOV? n : KW_MAX_IOV);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		for (; n > 0 && (size_t)r >= iov->iov_len; ++iov, --n)
+			r -= iov->iov_len;
+		if (n > 0) iov->iov_base = (char*)iov->iov_base + r, iov->iov_len -= r;
+	}
+	return 0;
+}
+
+static int kw_write_sink(const kwriter_t *w, struct iovec *iov, int n)
+{
+	int i;
+	if (w->fd >= 0) return kw_writev_fd(w->fd, iov, n);
+	for (i = 0; i < n; ++i) {
+		if (iov[i].iov_len == 0) continue;
+		if (w->fp) {
+			if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, w->fp) != iov[i].iov_len) return -1;
+		} else if (w->func(w->func_fp, iov[i].iov_base, iov[i].iov_len) != (ssize_t)iov[i].iov_len) return -1;
+	}
+	return 0;
+}
+
+static void *kw_flusher_worker(void *data)
+{
+	kwriter_t *w = (kwriter_t*)data;
+	kw_flusher_t *fl = w->fl;
+	kstring_t *buf = fl->buf;
+	struct iovec *iov = fl->iov;
+	pthread_mutex_lock(&fl->lock);
+	for (;;) {
+		int i, n, ret;
+		while (fl->n_pend == 0 && !fl->stop)
+			pthread_cond_wait(&fl->cv_work, &fl->lock);
+		if (fl->n_pend == 0) break; // stopped, with nothing left to write
+		n = fl->n_pend, fl->n_pend = 0;
+		memcpy(buf, fl->pend, n * sizeof(kstring_t));
+		pthread_mutex_unlock(&fl->lock);
+		for (i = 0; i < n; ++i)
+			iov[i].iov_base = buf[i].s, iov[i].iov_len = buf[i].l;
+		ret = kw_write_sink(w, iov, n);
+		pthread_mutex_lock(&fl->lock);
+		if (ret < 0) w->err = 1;
+		for (i = 0; i < n; ++i) {
+			buf[i].l = 0;
+			fl->spare[fl->n_spare++] = buf[i];
+		}
+		fl->n_busy -= n;
+		pthread_cond_signal(&fl->cv_main);
+	}
+	pthread_mutex_unlock(&fl->lock);
+	return 0;
+}
+
+int kw_start_flusher(kwriter_t *w, int n_buf)
+{
+	kw_flusher_t *fl;
+	if (w->fl) return 0;
+	if (n_buf < 1) n_buf = 1;
+	fl = (kw_flusher_t*)calloc(1, sizeof(kw_flusher_t));
+	if (fl == 0) return -1;
+	fl->n_buf = n_buf;
+	fl->pend = (kstring_t*)malloc(n_buf * sizeof(kstring_t));
+	fl->spare = (kstring_t*)malloc(n_buf * sizeof(kstring_t));
+	fl->buf = (kstring_t*)malloc(n_buf * sizeof(kstring_t));
+	fl->iov = (struct iovec*)malloc(n_buf * sizeof(struct iovec));
+	if (fl->pend == 0 || fl->spare == 0 || fl->buf == 0 || fl->iov == 0) goto fail_alloc;
+	pthread_mutex_init(&fl->lock, 0);
+	pthread_cond_init(&fl->cv_work, 0);
+	pthread_cond_init(&fl->cv_main, 0);
+	w->fl = fl;
+	if (pthread_create(&fl->tid, 0, kw_flusher_worker, w) != 0) {
+		w->fl = 0;
+		pthread_mutex_destroy(&fl->lock);
+		pthread_cond_destroy(&fl->cv_work);
+		pthread_cond_destroy(&fl->cv_main);
+		goto fail_alloc;
+	}
+	return 0;
+fail_alloc:
+	free(fl->pend); free(fl->spare); free(fl->buf); free(fl->iov); free(fl);
+	return -1;
+}
+
+int kw_flush(kwriter_t *w)
+{
+	kw_flusher_t *fl = w->fl;
+	int err;
+	if (fl == 0) {
+		if (w->s.l > 0) {
+			struct iovec iov;
+			iov.iov_base = w->s.s, iov.iov_len = w->s.l;
+			if (kw_write_sink(w, &iov, 1) < 0) w->err = 1;
+			w->s.l = 0;
+		}
+		return w->err? -1 : 0;
+	}
+	pthread_mutex_lock(&fl->lock); // w->err is set by the flusher thread
+	if (w->s.l > 0) {
+		while (fl->n_busy == fl->n_buf)
+			pthread_cond_wait(&fl->cv_main, &fl->lock);
+		fl->pend[fl->n_pend++] = w->s, ++fl->n_busy;
+		if (fl->n_spare > 0) w->s = fl->spare[--fl->n_spare];
+		else w->s.l = w->s.m = 0, w->s.s = 0;
+		pthread_cond_signal(&fl->cv_work);
+	}
+	err = w->err;
+	pthread_mutex_unlock(&fl->lock);
+	return err? -1 : 0;
+}
+
+int kw_write(kwriter_t *w, const void *buf, size_t len)
+{
+	if (w->fd >= 0 && w->fl == 0 && len >= w->hwm) { // write the buffer and the block together
+		struct iovec iov[2];
+		iov[0].iov_base = w->s.s, iov[0].iov_len = w->s.l;
+		iov[1].iov_base = (void*)buf, iov[1].iov_len = len;
+		if (kw_writev_fd(w->fd, iov, 2) < 0) w->err = 1;
+		w->s.l = 0;
+		return w->err? -1 : 0;
+	}
+	for (; len > INT_MAX; buf = (const char*)buf + INT_MAX, len -= INT_MAX) // kputsn_() takes an int
+		if (kputsn_(buf, INT_MAX, &w->s) < 0 || kw_check(w) < 0) return -1;
+	if (kputsn_(buf, len, &w->s) < 0) return -1;
+	return kw_check(w);
+}
+
+int kw_printf(kwriter_t *w, const char *fmt, ...)
+{
+	va_list ap;
+	int l;
+	va_start(ap, fmt);
+	l = kvsprintf(&w->s, fmt, ap);
+	va_end(ap);
+	if (l < 0) return -1;
+	return kw_check(w);
+}
+
+int kw_close(kwriter_t *w)
+{
+	kw_flusher_t *fl;
+	int err;
+	if (w == 0) return 0;
+	kw_flush(w);
+	fl = w->fl;
+	if (fl) {
+		int i;
+		pthread_mutex_lock(&fl->lock);
+		fl->stop = 1;
+		pthread_cond_signal(&fl->cv_work);
+		pthread_mutex_unlock(&fl->lock);
+		pthread_join(fl->tid, 0);
+		for (i = 0; i < fl->n_spare; ++i) free(fl->spare[i].s);
+		pthread_mutex_destroy(&fl->lock);
+		pthread_cond_destroy(&fl->cv_work);
+		pthread_cond_destroy(&fl->cv_main);
+		free(fl->pend); free(fl->spare); free(fl->buf); free(fl->iov); free(fl);
+	}
+	if (w->fp && fflush(w->fp) != 0) w->err = 1;
+	err = w->err;
+	free(w->s.s); free(w);
+	return err? -1 : 0;
+}
@@ -0,0 +1,99 @@
+#ifndef AC_KWRITER_H
+#define AC_KWRITER_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "kstring.h"
+
+/* kwriter_t collects output in a kstring_t and writes it out once the string
+ * reaches a high-water mark, to a file descriptor, a FILE* or a function such
+ * as bgzf_write(). Append with the kw_put*() functions below, or with any
+ * kstring.h function on &w->s followed by kw_check(w).
+ *
+ *       kwriter_t *w = kw_init_fd(1, 0);
+ *       kw_start_flusher(w, 4); // optional: write in a background thread
+ *       kw_puts("chr1\t", w); kw_putw(100, w); kw_putc('\n', w);
+ *       kw_close(w); // flushes; does not close the file descriptor
+ *
+ * For BGZF: kw_init_func(bgzf_fp, (kw_write_f*)bgzf_write, 0). */
+
+typedef ssize_t kw_write_f(void *fp, const void *buf, size_t len);
+
+struct kw_flusher_s;
+
+typedef struct {
+	kstring_t s; // the buffer being filled
+	size_t hwm; // high-water mark
+	int fd; // >=0 for a file descriptor sink
+	FILE *fp;
+	void *func_fp;
+	kw_write_f *func;
+	int err; // set on the first failed write
+	struct kw_flusher_s *fl; // the background flusher, or NULL
+} kwriter_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A high-water mark of 0 uses the default of 64KB. These return NULL if out of memory. */
+kwriter_t *kw_init_fd(int fd, size_t hwm);
+kwriter_t *kw_init_fp(FILE *fp, size_t hwm);
+kwriter_t *kw_init_func(void *fp, kw_write_f *func, size_t hwm);
+
+/* kw_start_flusher() writes filled buffers in a background thread, with up to
+ * _n_buf_ buffers queued; a file descriptor gets all queued buffers in one
+ * writev() call. The writer itself must still be used by one thread only.
+ * It returns -1 if the thread cannot be started, leaving _w_ unbuffered. */
+int kw_start_flusher(kwriter_t *w, int n_buf);
+
+/* kw_flush() writes out or queues the buffer regardless of the high-water
+ * mark. kw_write() appends a block; with a file descriptor and no flusher, a
+ * block larger than the high-water mark is written with writev() along with
+ * the buffer, without being copied. kw_close() flushes, stops the flusher
+ * and frees _w_, but leaves the sink open. These return -1 if any write has
+ * failed, or 0 otherwise. */
+int kw_flush(kwriter_t *w);
+int kw_write(kwriter_t *w, const void *buf, size_t len);
+int kw_printf(kwriter_t *w, const char *fmt, ...) KS_ATTR_PRINTF(2,3);
+int kw_close(kwriter_t *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline int kw_check(kwriter_t *w)
+{
+	return w->s.l >= w->hwm? kw_flush(w) : 0;
+}
+
+static inline int kw_putsn(const char *p, int l, kwriter_t *w)
+{
+	if (kputsn_(p, l, &w->s) < 0) return -1;
+	return kw_check(w);
+}
+
+static inline int kw_puts(const char *p, kwriter_t *w)
+{
+	return kw_putsn(p, strlen(p), w);
+}
+
+static inline int kw_putc(int c, kwriter_t *w)
+{
+	if (kputc_(c, &w->s) < 0) return -1;
+	return kw_check(w);
+}
+
+static inline int kw_putw(int c, kwriter_t *w)
+{
+	if (kputw(c, &w->s) < 0) return -1;
+	return kw_check(w);
+}
+
+static inline int kw_putl(long c, kwriter_t *w)
+{
+	if (kputl(c, &w->s) < 0) return -1;
+	return kw_check(w);
+}
+
+#endif
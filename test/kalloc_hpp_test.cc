@@ -0,0 +1,116 @@
+#include <cassert>
+#include <cstdio>
+#include <new>
+#include "cpp/kalloc.hpp"
+#include "cpp/khashl.hpp"
+#include "cpp/kavl.hpp"
+
+struct hash32 { uint32_t operator()(uint32_t x) const { return x * 0x9e3779b1U; } };
+
+template<class T> // an allocator that fails after a number of allocations, by throwing or by returning NULL
+class FailAllocator : public std::allocator<T> {
+public:
+	int *n_left;
+	bool do_throw;
+	template<class U> struct rebind { typedef FailAllocator<U> other; };
+	FailAllocator(int *n = 0, bool t = false) : n_left(n), do_throw(t) {}
+	template<class U> FailAllocator(const FailAllocator<U> &a) : n_left(a.n_left), do_throw(a.do_throw) {}
+	T *allocate(std::size_t n, const void* = 0) {
+		if (--*n_left < 0) {
+			if (do_throw) throw std::bad_alloc();
+			return 0;
+		}
+		return std::allocator<T>::allocate(n);
+	}
+	void deallocate(T *p, std::size_t n) { std::allocator<T>::deallocate(p, n); }
+};
+
+template<class Map>
+static void test_map(Map &h, int n)
+{
+	int i, absent;
+	for (i = 0; i < n; ++i) h[i * 3] = i;
+	uint32_t k = h.put(3, &absent);
+	assert(!absent && h.value(k) == 1);
+	for (i = 0; i < n; ++i) {
+		k = h.get(i * 3);
+		assert(k != h.end() && h.value(k) == i);
+	}
+	assert(h.get(1) == h.end() && h.size() == (uint32_t)n);
+	for (i = 0; i < n; i += 2) h.del(h.get(i * 3));
+	assert(h.size() == (uint32_t)(n / 2));
+}
+
+template<class Tree>
+static void test_avl(Tree &t, int n)
+{
+	int i;
+	unsigned cnt;
+	bool is_new;
+	for (i = n - 1; i >= 0; --i) t.insert(i * 2, &is_new), assert(is_new);
+	t.insert(10, &is_new);
+	assert(!is_new && t.size() == (unsigned)n);
+	assert(*t.find(20, &cnt) == 20 && cnt == 11); // 0, 2, ..., 20
+	assert(t.find(21) == 0);
+}
+
+template<class Set>
+static void test_fail(bool do_throw)
+{
+	int i, absent, n_left = 1 << 30;
+	Set h(FailAllocator<uint32_t>(&n_left, do_throw));
+	for (i = 0; i < 12; ++i) h.put(i, &absent); // fills 16 buckets to the load limit
+	n_left = 0;
+	assert(h.put(100, &absent) == h.end() && absent == -1);
+	assert(h.size() == 12 && h.get(5) != h.end());
+	n_left = 1 << 30;
+	assert(h.put(100, &absent) != h.end() && absent == 1);
+}
+
+static void test_avl_fail(void)
+{
+	int i, n_left = 1 << 30;
+	bool is_new;
+	klib::Avl<int, std::less<int>, FailAllocator<int> > t(FailAllocator<int>(&n_left, false));
+	for (i = 0; i < 100; ++i) t.insert(i);
+	n_left = 0;
+	assert(t.insert(1000, &is_new) == 0 && !is_new);
+	assert(t.size() == 100 && t.find(1000) == 0 && *t.find(50) == 50);
+	assert(t.insert(50, &is_new) != 0 && !is_new); // present keys need no allocation
+	n_left = 1 << 30;
+	assert(t.insert(1000, &is_new) != 0 && is_new && t.size() == 101);
+}
+
+int main(void)
+{
+	void *km = km_init();
+	int n = 10000;
+	{
+		klib::KHashMap<uint32_t, int, hash32> h1;
+		klib::KHashMap<uint32_t, int, hash32, std::equal_to<uint32_t>, uint32_t, klib::KAllocator<int> > h2(km);
+		klib::KHashMapCached<uint32_t, int, hash32, std::equal_to<uint32_t>, uint32_t, klib::KAllocator<int> > h3(km);
+		test_map(h1, n), test_map(h2, n), test_map(h3, n);
+		klib::Avl<int> t1;
+		klib::Avl<int, std::less<int>, klib::KAllocator<int> > t2(km);
+		test_avl(t1, n), test_avl(t2, n);
+	}
+	{
+		klib::KArena arena(km);
+		klib::KArena::Scope scope(arena);
+		klib::KHashSet<uint32_t, hash32, std::equal_to<uint32_t>, uint32_t, klib::KAllocator<uint32_t> > s(arena.allocator<uint32_t>());
+		klib::Avl<int, std::less<int>, klib::KAllocator<int> > t(arena.allocator<int>());
+		int absent;
+		for (int i = 0; i < n; ++i) s.put(i, &absent);
+		assert(s.size() == (uint32_t)n);
+		test_avl(t, n);
+	}
+	test_fail<klib::KHashSet<uint32_t, hash32, std::equal_to<uint32_t>, uint32_t, FailAllocator<uint32_t> > >(false);
+	test_fail<klib::KHashSet<uint32_t, hash32, std::equal_to<uint32_t>, uint32_t, FailAllocator<uint32_t> > >(true);
+	test_avl_fail();
+	km_stat_t st;
+	km_stat(km, &st);
+	assert(st.n_blocks == st.n_cores); // everything has been freed
+	km_destroy(km);
+	printf("passed\n");
+	return 0;
+}
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include "kalloc.h"
+#include "kthread.h"
+#include "khashl.h" // after kalloc.h, such that hash tables allocate with kalloc
+
+KHASHL_MAP_INIT(KH_LOCAL, imap_t, imap, khint32_t, int, kh_hash_uint32, kh_eq_generic)
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static size_t rand_size(uint64_t *x)
+{
+	uint64_t r = splitmix64(x);
+	return (r & 7) == 0? (r >> 8) % 100000 + 1 : (r >> 8) % 512 + 1; // mostly small blocks
+}
+
+static void fill(uint8_t *p, size_t size, uint64_t seed)
+{
+	size_t i;
+	for (i = 0; i < size; ++i) p[i] = (uint8_t)(seed + i);
+}
+
+static int check(const uint8_t *p, size_t size, uint64_t seed)
+{
+	size_t i;
+	for (i = 0; i < size; ++i)
+		if (p[i] != (uint8_t)(seed + i)) return 0;
+	return 1;
+}
+
+static void test_basic(void *km)
+{
+	int i, n = 20000;
+	uint8_t **a;
+	size_t *sz;
+	uint64_t x = 1;
+	a = Kcalloc(km, uint8_t*, n);
+	sz = Kcalloc(km, size_t, n);
+	for (i = 0; i < n; ++i) {
+		sz[i] = rand_size(&x);
+		a[i] = Kmalloc(km, uint8_t, sz[i]);
+		fill(a[i], sz[i], i);
+	}
+	for (i = 0; i < n; i += 2) kfree(km, a[i]), a[i] = 0;
+	for (i = 1; i < n; i += 2) {
+		assert(check(a[i], sz[i], i));
+		a[i] = Krealloc(km, uint8_t, a[i], sz[i] * 2);
+		assert(check(a[i], sz[i], i));
+	}
+	for (i = 0; i < n; ++i) kfree(km, a[i]);
+	kfree(km, a); kfree(km, sz);
+}
+
+static void test_core_sizes(void) // blocks that nearly fill a new core must still be found in it
+{
+	size_t k, d, n;
+	void *km, *p;
+	for (k = 1; k <= 4; ++k) {
+		for (d = 0; d < 64; ++d) {
+			n = k * 256 * 16 - 64 + d; // 256-unit cores of 16 bytes
+			km = km_init2(0, 256);
+			p = kmalloc(km, n);
+			assert(p);
+			memset(p, 0, n);
+			kfree(km, p);
+			km_destroy(km);
+		}
+	}
+	km = km_init();
+	p = kmalloc(km, 16777168); // 2 default cores, minus the core header and the fence
+	assert(p);
+	kfree(km, p);
+	km_destroy(km);
+}
+
+#define N_SLOTS 1024
+
+typedef struct {
+	void *km;
+	uint8_t *volatile slot[N_SLOTS];
+	int n_rounds;
+} mt_data_t;
+
+static void mt_worker(void *_d, long k, int tid) // swap blocks through shared slots, such that most are freed by another thread
+{
+	mt_data_t *d = (mt_data_t*)_d;
+	uint64_t x = k;
+	int i;
+	for (i = 0; i < d->n_rounds; ++i) {
+		size_t size = rand_size(&x);
+		uint8_t *p, *q;
+		p = Kmalloc(d->km, uint8_t, size + sizeof(size_t));
+		*(size_t*)p = size;
+		fill(p + sizeof(size_t), size, size);
+		q = __atomic_exchange_n(&d->slot[splitmix64(&x) % N_SLOTS], p, __ATOMIC_ACQ_REL);
+		if (q) {
+			assert(check(q + sizeof(size_t), *(size_t*)q, *(size_t*)q));
+			kfree(d->km, q);
+		}
+	}
+}
+
+static void test_mt(int n_threads, int n_rounds)
+{
+	mt_data_t d;
+	km_stat_t st;
+	int i;
+	memset(&d, 0, sizeof(mt_data_t));
+	d.km = km_init_mt();
+	d.n_rounds = n_rounds;
+	kt_for(n_threads, mt_worker, &d, n_threads * 4);
+	for (i = 0; i < N_SLOTS; ++i)
+		kfree(d.km, d.slot[i]);
+	km_stat(d.km, &st);
+	printf("[mt] %d threads: cap=%ld, n_cores=%ld\n", n_threads, (long)st.capacity, (long)st.n_cores);
+	km_destroy(d.km);
+}
+
+#define N_ADOPT 100
+
+typedef struct {
+	void *km;
+	void *p[N_ADOPT];
+	int freed;
+} adopt_data_t;
+
+static void *adopt_worker(void *_d)
+{
+	adopt_data_t *d = (adopt_data_t*)_d;
+	int i;
+	for (i = 0; i < N_ADOPT; ++i) d->p[i] = kmalloc(d->km, 100);
+	if (!d->freed) // the first thread; its free lists go with its heap
+		for (i = 0; i < N_ADOPT; ++i) kfree(d->km, d->p[i]);
+	return 0;
+}
+
+static void test_adopt(void) // a thread started after another exits takes over its heap, with blocks on the free lists
+{
+	adopt_data_t d;
+	void *p[N_ADOPT];
+	pthread_t tid;
+	int i, j;
+	memset(&d, 0, sizeof(adopt_data_t));
+	d.km = km_init_mt();
+	pthread_create(&tid, 0, adopt_worker, &d);
+	pthread_join(tid, 0);
+	memcpy(p, d.p, sizeof(p));
+	d.freed = 1;
+	pthread_create(&tid, 0, adopt_worker, &d);
+	pthread_join(tid, 0);
+	for (i = 0; i < N_ADOPT; ++i) {
+		for (j = 0; j < N_ADOPT && d.p[i] != p[j]; ++j);
+		assert(j < N_ADOPT);
+		kfree(d.km, d.p[i]);
+	}
+	km_destroy(d.km);
+}
+
+static void test_prof(void)
+{
+	void *km, *p[100], *q[10];
+	const char *tag;
+	km_prof_stat_t ps;
+	size_t in_use0;
+	long n, bytes;
+	int i;
+	km = km_init();
+	p[0] = kmalloc(km, 100); // allocated before profiling
+	km_prof(km, 1);
+	assert(km_prof_stat(km, &ps) == 0 && ps.n_alloc == 0 && ps.in_use > 100);
+	in_use0 = ps.in_use;
+	KM_TAG(km), tag = __FILE__ ":" KM_STR(__LINE__);
+	for (i = 0; i < 10; ++i) q[i] = kmalloc(km, 1000);
+	km_tag(km, "small");
+	for (i = 1; i < 100; ++i) p[i] = kmalloc(km, i);
+	km_prof_stat(km, &ps);
+	assert(ps.n_alloc == 109 && ps.n_free == 0 && ps.bytes == 10 * 1000 + 4950);
+	assert(ps.in_use >= in_use0 + 10 * 1000 + 4950 && ps.peak >= ps.in_use && ps.capacity >= ps.in_use);
+	assert(km_prof_tag(km, tag, &n, &bytes) == 0 && n == 10 && bytes == 10 * 1000);
+	assert(km_prof_tag(km, "small", &n, &bytes) == 0 && n == 99 && bytes == 4950);
+	assert(km_prof_tag(km, "none", &n, &bytes) < 0);
+	for (i = 0; i < 10; ++i) kfree(km, q[i]);
+	for (i = 1; i < 100; ++i) kfree(km, p[i]);
+	km_prof_stat(km, &ps);
+	assert(ps.n_free == 109 && ps.in_use == in_use0 && ps.peak >= in_use0 + 10 * 1000 + 4950);
+	kfree(km, p[0]);
+	km_tag(km, 0);
+	test_basic(km);
+	km_prof_stat(km, &ps);
+	assert(ps.n_free == ps.n_alloc + 1 && ps.in_use == 0); // +1 for p[0]
+	km_stat_print(km);
+	km_destroy(km);
+}
+
+static void test_arena(void)
+{
+	void *km, *ka;
+	km_mark_t m;
+	km_stat_t st;
+	imap_t *h;
+	uint8_t *p, *q;
+	int i, absent;
+	khint_t k;
+	km = km_init();
+	ka = km_init_arena(km, 1<<16);
+	test_basic(ka);
+	km_reset(ka);
+	p = Kmalloc(ka, uint8_t, 100);
+	fill(p, 100, 1);
+	q = Krealloc(ka, uint8_t, p, 1000); // the last allocation grows in place
+	assert(q == p && check(q, 100, 1));
+	kfree(ka, q);
+	assert(Kmalloc(ka, uint8_t, 10) == p); // kfree() on the last allocation rolls back
+	m = km_mark(ka);
+	h = imap_init2(ka);
+	for (i = 0; i < 100000; ++i) {
+		k = imap_put(h, i * 7, &absent);
+		kh_val(h, k) = i;
+	}
+	for (i = 0; i < 100000; ++i) {
+		k = imap_get(h, i * 7);
+		assert(k != kh_end(h) && kh_val(h, k) == i);
+	}
+	imap_destroy(h);
+	km_release_to_mark(ka, m);
+	assert(Kmalloc(ka, uint8_t, 10) == p + 24); // 8-byte size header + 10 bytes, rounded up to 24
+	km_stat(ka, &st);
+	assert(st.n_cores > 1);
+	km_trim(ka); // chunks released to the mark are returned to the parent
+	km_stat(ka, &st);
+	assert(st.n_cores == 1);
+	km_destroy(ka);
+	km_stat(km, &st);
+	assert(st.n_blocks == st.n_cores); // everything has been returned to the parent
+	km_destroy(km);
+}
+
+int main(int argc, char *argv[])
+{
+	void *km;
+	km_stat_t st;
+	int n_threads = argc > 1? atoi(argv[1]) : 4;
+	int n_rounds = argc > 2? atoi(argv[2]) : 10000;
+	test_basic(0);
+	test_core_sizes();
+	km = km_init();
+	test_basic(km);
+	km_stat_print(km);
+	km_destroy(km);
+	km = km_init3(0, 1<<20, KM_CORE_MMAP|KM_CORE_THP|KM_CORE_RELEASE); // completely free cores are returned
+	test_basic(km);
+	km_stat(km, &st);
+	assert(st.n_cores == 1 && st.n_blocks == 1);
+	km_destroy(km);
+	km = km_init3(0, 1<<20, KM_CORE_MMAP);
+	test_basic(km);
+	km_trim(km);
+	km_stat(km, &st);
+	assert(st.n_cores == 1 && st.n_blocks == 1);
+	test_basic(km); // reuse after trimming
+	km_destroy(km);
+	km = km_init_mt();
+	test_basic(km);
+	km_destroy(km);
+	test_mt(n_threads, n_rounds);
+	test_adopt();
+	test_arena();
+	test_prof();
+	printf("passed\n");
+	return 0;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "kmempool.h"
+#include "kthread.h"
+
+typedef struct {
+	uint64_t key;
+	void *left, *right; // a typical tree node
+} node_t;
+
+static void test_basic(void *mp)
+{
+	int i, n = 100000;
+	node_t **a;
+	a = (node_t**)malloc(n * sizeof(node_t*));
+	for (i = 0; i < n; ++i) {
+		a[i] = (node_t*)kmp_alloc(mp);
+		a[i]->key = i;
+	}
+	for (i = 0; i < n; i += 2) kmp_free(mp, a[i]);
+	for (i = 0; i < n; i += 2) a[i] = (node_t*)kmp_alloc(mp), a[i]->key = i;
+	for (i = 0; i < n; ++i) {
+		assert(a[i]->key == (uint64_t)i);
+		kmp_free(mp, a[i]);
+	}
+	free(a);
+}
+
+static long rss_kb(void)
+{
+	long size = 0, rss = 0;
+	FILE *fp;
+	if ((fp = fopen("/proc/self/statm", "r")) == 0) return -1;
+	if (fscanf(fp, "%ld%ld", &size, &rss) != 2) rss = -1;
+	fclose(fp);
+	return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void test_trim(void *mp)
+{
+	int i, n = 4000000;
+	node_t **a;
+	long rss[3];
+	a = (node_t**)malloc(n * sizeof(node_t*));
+	for (i = 0; i < n; ++i) a[i] = (node_t*)kmp_alloc(mp), a[i]->key = i;
+	rss[0] = rss_kb();
+	for (i = 0; i < n; ++i)
+		if (i % 1000 != 0) kmp_free(mp, a[i]); // keep a few entries in each chunk
+	kmp_trim(mp);
+	rss[1] = rss_kb();
+	for (i = 0; i < n; i += 1000) {
+		assert(a[i]->key == (uint64_t)i);
+		kmp_free(mp, a[i]);
+	}
+	kmp_trim(mp);
+	rss[2] = rss_kb();
+	for (i = 0; i < n; ++i) a[i] = (node_t*)kmp_alloc(mp), a[i]->key = i; // reuse after trimming
+	for (i = 0; i < n; ++i) {
+		assert(a[i]->key == (uint64_t)i);
+		kmp_free(mp, a[i]);
+	}
+	fprintf(stderr, "[trim] RSS: %ld kB allocated; %ld kB partially freed; %ld kB freed\n", rss[0], rss[1], rss[2]);
+	if (rss[0] >= 0) // no /proc otherwise; at least half of the node memory must be returned
+		assert(rss[2] < rss[0] - (long)(n * sizeof(node_t) / 1024 / 2));
+	free(a);
+}
+
+#define N_SLOTS 4096
+
+typedef struct {
+	void *mp;
+	node_t *volatile slot[N_SLOTS];
+	int n_rounds;
+} mt_data_t;
+
+static void mt_worker(void *_d, long k, int tid) // most frees are local; one in four goes through a shared slot
+{
+	mt_data_t *d = (mt_data_t*)_d;
+	uint64_t x = k * 0x9e3779b97f4a7c15ULL + 1;
+	int i;
+	for (i = 0; i < d->n_rounds; ++i) {
+		node_t *p, *q;
+		x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+		p = (node_t*)kmp_alloc(d->mp);
+		p->key = x, p->left = p->right = p;
+		if ((x & 3) == 0) {
+			q = __atomic_exchange_n(&d->slot[x % N_SLOTS], p, __ATOMIC_ACQ_REL);
+			if (q == 0) continue;
+		} else q = p;
+		assert(q->left == q && q->right == q);
+		kmp_free(d->mp, q);
+	}
+}
+
+static void test_mt(void *mp, int n_threads, int n_rounds)
+{
+	mt_data_t d;
+	clock_t t;
+	int i;
+	memset(&d, 0, sizeof(mt_data_t));
+	d.mp = mp, d.n_rounds = n_rounds;
+	t = clock();
+	kt_for(n_threads, mt_worker, &d, n_threads * 4);
+	fprintf(stderr, "[mt] %d threads, %d rounds: %.3f CPU sec\n", n_threads, n_rounds, (double)(clock() - t) / CLOCKS_PER_SEC);
+	for (i = 0; i < N_SLOTS; ++i)
+		if (d.slot[i]) kmp_free(mp, d.slot[i]);
+}
+
+#define N_MAG_ENTRIES 256 // a multiple of the magazine size, such that the first thread leaves no spare entries behind
+
+typedef struct {
+	void *mp;
+	void *p[N_MAG_ENTRIES];
+	int freed;
+} mag_data_t;
+
+static void *mag_worker(void *_d)
+{
+	mag_data_t *d = (mag_data_t*)_d;
+	int i;
+	for (i = 0; i < N_MAG_ENTRIES; ++i) d->p[i] = kmp_alloc(d->mp);
+	if (!d->freed) // the first thread; its magazines go to the depot when it exits
+		for (i = 0; i < N_MAG_ENTRIES; ++i) kmp_free(d->mp, d->p[i]);
+	return 0;
+}
+
+static void test_magazine(void) // a later thread gets its entries from the magazines of an exited thread
+{
+	mag_data_t d;
+	void *p[N_MAG_ENTRIES];
+	pthread_t tid;
+	int i, j;
+	memset(&d, 0, sizeof(mag_data_t));
+	d.mp = kmp_init_mt(sizeof(node_t));
+	pthread_create(&tid, 0, mag_worker, &d);
+	pthread_join(tid, 0);
+	memcpy(p, d.p, sizeof(p));
+	d.freed = 1;
+	pthread_create(&tid, 0, mag_worker, &d);
+	pthread_join(tid, 0);
+	for (i = 0; i < N_MAG_ENTRIES; ++i) {
+		for (j = 0; j < N_MAG_ENTRIES && d.p[i] != p[j]; ++j);
+		assert(j < N_MAG_ENTRIES);
+		kmp_free(d.mp, d.p[i]);
+	}
+	kmp_destroy(d.mp);
+}
+
+int main(int argc, char *argv[])
+{
+	int n_threads = argc > 1? atoi(argv[1]) : 4;
+	int n_rounds = argc > 2? atoi(argv[2]) : 1000000;
+	void *mp;
+	mp = kmp_init(sizeof(node_t));
+	test_basic(mp);
+	test_trim(mp);
+	kmp_destroy(mp);
+	mp = kmp_init_mt(sizeof(node_t));
+	test_basic(mp);
+	test_mt(mp, n_threads, n_rounds);
+	kmp_trim(mp);
+	kmp_destroy(mp);
+	test_magazine();
+	printf("passed\n");
+	return 0;
+}
@@ -7,6 +7,9 @@
 
 #define BUF_SIZE 4096
 KSTREAM_INIT(gzFile, gzread, BUF_SIZE)
+__KSEQ_TYPE(gzFile)
+__KSEQ_BASIC(static, gzFile)
+__KSEQ_READ(static)
 
 int main(int argc, char *argv[])
 {
@@ -49,6 +52,18 @@ int main(int argc, char *argv[])
 		gzclose(fp);
 		free(s->s); free(s);
 	}
+	{
+		kseq_t *seq;
+		int64_t n = 0, l = 0;
+		int r;
+		fp = gzopen(argv[1], "r");
+		seq = kseq_init(fp);
+		t = clock();
+		while ((r = kseq_read(seq)) >= 0) ++n, l += r;
+		fprintf(stderr, "[kseq_read] %.2f sec; %ld sequences, %ld bases\n", (float)(clock() - t) / CLOCKS_PER_SEC, (long)n, (long)l);
+		kseq_destroy(seq);
+		gzclose(fp);
+	}
 	if (argc == 2) {
 		fp = gzopen(argv[1], "r");
 		t = clock();
@@ -1,7 +1,166 @@
 #include <zlib.h>
 #include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#ifdef KSEQ_TEST_RA
+#define KSEQ_RA
+#endif
 #include "kseq.h"
+#ifdef KSEQ_TEST_RA
+KSEQ_INIT_RA(gzFile, gzread) // decompress in a background thread
+#else
 KSEQ_INIT(gzFile, gzread)
+#endif
+
+static int test_mem(gzFile fp, int n_split) // read the whole file into memory and parse it with kseq_mem_read()
+{
+	kseq_mem_t *m;
+	char *buf = 0;
+	size_t len = 0, cap = 0, off[17];
+	int i, l = -1;
+	for (;;) {
+		if (len == cap) {
+			cap = cap? cap << 1 : 65536;
+			buf = (char*)realloc(buf, cap);
+		}
+		if ((l = gzread(fp, buf + len, cap - len)) <= 0) break;
+		len += l;
+	}
+	kseq_mem_split(buf, len, n_split, off); // the ranges are parsed one after another here
+	for (i = 0; i < n_split && l >= -1; ++i) {
+		m = kseq_mem_init(buf + off[i], off[i+1] - off[i]);
+		while ((l = kseq_mem_read(m)) >= 0) {
+			printf("name: %.*s\n", (int)m->name.l, m->name.s);
+			if (m->comment.l) printf("comment: %.*s\n", (int)m->comment.l, m->comment.s);
+			printf("seq: %.*s\n", (int)m->seq.l, m->seq.s);
+			if (m->qual.l) printf("qual: %.*s\n", (int)m->qual.l, m->qual.s);
+		}
+		kseq_mem_destroy(m);
+	}
+	printf("return value: %d\n", l);
+	free(buf);
+	return 0;
+}
+
+static int test_batch(gzFile fp) // read in batches of at most 3 records or 64 bytes
+{
+	kseq_t *seq;
+	kseq_batch_t b = {0,0,0,0,0,0};
+	int i, n;
+	seq = kseq_init(fp);
+	do {
+		n = kseq_read_batch(seq, 3, 64, &b);
+		for (i = 0; i < b.n; ++i) { // on errors, b holds the records before the error
+			printf("name: %s\n", kseq_batch_name(&b, i));
+			if (b.rec[i].l_comment) printf("comment: %s\n", kseq_batch_comment(&b, i));
+			printf("seq: %s\n", kseq_batch_seq(&b, i));
+			if (b.rec[i].l_qual) printf("qual: %s\n", kseq_batch_qual(&b, i));
+		}
+	} while (n > 0);
+	printf("return value: %d\n", n == 0? -1 : n);
+	kseq_batch_destroy(&b);
+	kseq_destroy(seq);
+	return 0;
+}
+
+static int test_pair(gzFile fp, const char *fn2) // read pairs in batches of at most 2 pairs
+{
+	gzFile fp2;
+	kseq_t *s1, *s2;
+	kseq_batch_t b = {0,0,0,0,0,0};
+	int i, n;
+	fp2 = gzopen(fn2, "r");
+	s1 = kseq_init(fp), s2 = kseq_init(fp2);
+	do {
+		n = kseq_read_pair(s1, s2, 2, 1<<20, &b);
+		for (i = 0; i < b.n; ++i)
+			printf("%s\t%s\t%s\n", kseq_batch_name(&b, i), kseq_batch_seq(&b, i), kseq_batch_qual(&b, i));
+	} while (n > 0);
+	printf("return value: %d\n", n);
+	kseq_batch_destroy(&b);
+	kseq_destroy(s1); kseq_destroy(s2);
+	gzclose(fp2);
+	return 0;
+}
+
+static int test_pack(gzFile fp, const char *fn) // print sequences decoded from the 2-bit and 4-bit encodings made while parsing
+{
+	gzFile fp4;
+	kseq_t *s2, *s4;
+	kseq_pack_t *p2, *p4;
+	size_t i, k;
+	int l;
+	fp4 = gzopen(fn, "r");
+	s2 = kseq_init(fp), s4 = kseq_init(fp4);
+	p2 = &s2->pack, p4 = &s4->pack;
+	p2->bits = 2, p4->bits = 4;
+	while ((l = kseq_read(s2)) >= 0 && kseq_read(s4) == l) {
+		kstring_t *t = &s2->seq;
+		assert(t->l == 0 && p2->l == (size_t)l && p4->l == (size_t)l);
+		if (t->m < (size_t)l + 1) t->m = l + 1, t->s = (char*)realloc(t->s, t->m);
+		for (i = 0; i < p2->l; ++i) t->s[i] = "ACGT"[kseq_pack_get(p2, i)];
+		for (k = 0; k < p2->n_run; ++k)
+			for (i = p2->run[k].st; i < p2->run[k].en; ++i) t->s[i] = 'N';
+		t->s[l] = 0;
+		printf("name: %s\nseq2: %s\nseq4: ", s2->name.s, t->s);
+		for (i = 0; i < p4->l; ++i) putchar("=ACMGRSVTWYHKDBN"[kseq_pack_get(p4, i)]);
+		printf("\nruns: %ld %ld\n", (long)p2->n_run, (long)p4->n_run);
+	}
+	printf("return value: %d\n", l);
+	kseq_destroy(s2); kseq_destroy(s4);
+	gzclose(fp4);
+	return 0;
+}
+
+static int test_crlf(void) // CRLF and empty records must parse the same with kseq_read(), packing and kseq_mem_read()
+{
+	static const char *data = "@r1\r\n\r\n+\r\n\r\n@r2 c\r\nAC\r\nGT\r\n+\r\nII\r\nII\r\n>f1\r\nAC\r\n\r\nGT\r\n@r3\n\n+\n\n";
+	static const char *name[] = { "r1", "r2", "f1", "r3" }, *seq[] = { "", "ACGT", "ACGT", "" }, *qual[] = { "", "IIII", "", "" };
+	const char *fn = "kseq_test.tmp";
+	FILE *fp;
+	gzFile gz;
+	kseq_t *ks;
+	kseq_mem_t *m;
+	int i, k, l;
+	fp = fopen(fn, "wb");
+	fputs(data, fp);
+	fclose(fp);
+	for (k = 0; k < 2; ++k) { // k=1: pack while parsing
+		gz = gzopen(fn, "r");
+		ks = kseq_init(gz);
+		if (k) ks->pack.bits = 2;
+		for (i = 0; (l = kseq_read(ks)) >= 0; ++i) {
+			assert(i < 4 && l == (int)strlen(seq[i]) && strcmp(ks->name.s, name[i]) == 0);
+			assert(k || strcmp(ks->seq.s, seq[i]) == 0);
+			assert(ks->qual.l == strlen(qual[i]) && (ks->qual.l == 0 || strcmp(ks->qual.s, qual[i]) == 0));
+		}
+		assert(i == 4 && l == -1);
+		kseq_destroy(ks);
+		gzclose(gz);
+	}
+	m = kseq_mem_init(data, strlen(data));
+	for (i = 0; (l = kseq_mem_read(m)) >= 0; ++i) {
+		assert(i < 4 && l == (int)strlen(seq[i]) && m->qual.l == strlen(qual[i]));
+		assert(memcmp(m->seq.s, seq[i], l) == 0 && memcmp(m->qual.s, qual[i], m->qual.l) == 0);
+	}
+	assert(i == 4 && l == -1);
+	kseq_mem_destroy(m);
+	unlink(fn);
+	return 0;
+}
+
+static int test_sync(void) // split points must land on headers after a BOM and blank lines; qualities may start with '@'
+{
+	static const char *data = "\xef\xbb\xbf\r\n\n@r1\nACGT\n+\n@III\n@r2 c\nAC\n+\n@@\n@r3\nA\n+\nI\n";
+	size_t len = strlen(data), pos, r, hdr[] = { 6, 22, 36, 46 }; // 46: the end
+	int i;
+	for (pos = 1; pos < len; ++pos) {
+		r = kseq_mem_sync(data, len, pos);
+		for (i = 0; hdr[i] < pos; ++i);
+		assert(r == hdr[i]);
+	}
+	return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -9,10 +168,25 @@ int main(int argc, char *argv[])
 	kseq_t *seq;
 	int l;
 	if (argc == 1) {
-		fprintf(stderr, "Usage: %s <in.fasta>\n", argv[0]);
+		fprintf(stderr, "Usage: %s <in.fasta> [mem|split|batch|pack|pair <in2.fasta>]\n", argv[0]);
+		fprintf(stderr, "       %s -t    # run built-in checks\n", argv[0]);
 		return 1;
 	}
+	if (strcmp(argv[1], "-t") == 0) {
+		test_crlf(), test_sync();
+		printf("passed\n");
+		return 0;
+	}
 	fp = gzopen(argv[1], "r");
+	if (argc > 2) {
+		if (strcmp(argv[2], "batch") == 0) test_batch(fp);
+		else if (strcmp(argv[2], "pair") == 0 && argc > 3) test_pair(fp, argv[3]);
+		else if (strcmp(argv[2], "split") == 0) test_mem(fp, 16);
+		else if (strcmp(argv[2], "pack") == 0) test_pack(fp, argv[1]);
+		else test_mem(fp, 1);
+		gzclose(fp);
+		return 0;
+	}
 	seq = kseq_init(fp);
 	while ((l = kseq_read(seq)) >= 0) {
 		printf("name: %s\n", seq->name.s);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "kstring.h"
 
@@ -47,5 +48,169 @@ int main()
 		ksprintf(&s, "%s", s2.s);
 	}
 	fprintf(stderr, "kputw+ksprintf: %lf\n", (double)(clock() - t) / CLOCKS_PER_SEC);
+
+	{ // split a VCF-like line into fields
+		const char *p;
+		int n, max = 0, *offsets = 0;
+		long sum = 0;
+		ks_tokaux_t aux;
+		s.l = 0;
+		for (i = 0; i < 200; ++i)
+			ksprintf(&s, "chr1\t%d\t.\tA\tG\t50\tPASS\tDP=%d;AF=0.5\tGT:DP\t0/1:%d\t", i * 1000, i, i);
+		s.s[--s.l] = 0;
+		s2.l = 0;
+		kputsn(s.s, s.l, &s2);
+		t = clock();
+		for (i = 0; i < N / 1000; ++i) {
+			memcpy(s2.s, s.s, s.l);
+			n = ksplit_core(s2.s, '\t', &max, &offsets);
+			sum += offsets[n - 1];
+		}
+		fprintf(stderr, "ksplit: %lf (%ld)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+		t = clock();
+		for (i = 0; i < N / 1000; ++i) {
+			memcpy(s2.s, s.s, s.l);
+			n = ksplit_core(s2.s, 0, &max, &offsets);
+			sum += offsets[n - 1];
+		}
+		fprintf(stderr, "ksplit (spaces): %lf (%ld)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+		t = clock();
+		for (i = 0; i < N / 1000; ++i)
+			for (p = kstrtok(s.s, "\t", &aux); p; p = kstrtok(0, 0, &aux))
+				sum += aux.p - p;
+		fprintf(stderr, "kstrtok: %lf (%ld)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+		t = clock();
+		for (i = 0; i < N / 1000; ++i)
+			for (p = kstrtok(s.s, "\t;:", &aux); p; p = kstrtok(0, 0, &aux))
+				sum += aux.p - p;
+		fprintf(stderr, "kstrtok (3 separators): %lf (%ld)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+		s.l = 0; // long fields, such as sequences in SAM
+		for (i = 0; i < 20; ++i) {
+			int j;
+			for (j = 0; j < 400; ++j) kputc("ACGT"[j&3], &s);
+			kputc('\t', &s);
+		}
+		t = clock();
+		for (i = 0; i < N / 1000; ++i)
+			for (p = kstrtok(s.s, "\t", &aux); p; p = kstrtok(0, 0, &aux))
+				sum += aux.p - p;
+		fprintf(stderr, "kstrtok (long fields): %lf (%ld)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+		s2.l = 0;
+		kputsn(s.s, s.l, &s2);
+		t = clock();
+		for (i = 0; i < N / 1000; ++i) {
+			memcpy(s2.s, s.s, s.l);
+			n = ksplit_core(s2.s, '\t', &max, &offsets);
+			sum += offsets[n - 1];
+		}
+		fprintf(stderr, "ksplit (long fields): %lf (%ld)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+		free(offsets);
+	}
+	{ // format and parse doubles
+		const char *end;
+		double sum = 0;
+		srand48(11);
+		t = clock();
+		for (i = 0; i < N / 10; ++i) {
+			s.l = 0;
+			kputd(drand48() * 1000.0, &s);
+		}
+		fprintf(stderr, "kputd: %lf\n", (double)(clock() - t) / CLOCKS_PER_SEC);
+		srand48(11);
+		t = clock();
+		for (i = 0; i < N / 10; ++i) {
+			s.l = 0;
+			ksprintf(&s, "%.17g", drand48() * 1000.0);
+		}
+		fprintf(stderr, "ksprintf(%%.17g): %lf\n", (double)(clock() - t) / CLOCKS_PER_SEC);
+		s.l = 0;
+		for (i = 0; i < 1000; ++i) {
+			kputw(lrand48() % 100000, &s);
+			kputc('.', &s);
+			kputw(lrand48() % 1000, &s);
+			kputc('\t', &s);
+		}
+		t = clock();
+		for (i = 0; i < N / 1000; ++i) {
+			const char *p = s.s;
+			while (p < s.s + s.l) sum += kstrtod(p, s.s + s.l - p, &end), p = end + 1;
+		}
+		fprintf(stderr, "kstrtod: %lf (%g)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+		t = clock();
+		for (i = 0; i < N / 1000; ++i) {
+			char *p = s.s, *q;
+			while (p < s.s + s.l) sum += strtod(p, &q), p = q + 1;
+		}
+		fprintf(stderr, "strtod: %lf (%g)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+		s.l = 0;
+		for (i = 0; i < 1000; ++i) // exponents out of [-22,22] always take the strtod() fallback
+			ksprintf(&s, "%ld.%03lde-%d\t", lrand48() % 100000, lrand48() % 1000, 30 + (int)(lrand48() % 200));
+		t = clock();
+		for (i = 0; i < N / 10000; ++i) {
+			const char *p = s.s;
+			while (p < s.s + s.l) sum += kstrtod(p, s.s + s.l - p, &end), p = end + 1;
+		}
+		fprintf(stderr, "kstrtod (fallback): %lf (%g)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+		t = clock();
+		for (i = 0; i < N / 10000; ++i) {
+			char *p = s.s, *q;
+			while (p < s.s + s.l) sum += strtod(p, &q), p = q + 1;
+		}
+		fprintf(stderr, "strtod (fallback): %lf (%g)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+	}
+
+	{ // short-lived short strings
+		long sum = 0;
+		t = clock();
+		for (i = 0; i < N; ++i) {
+			kstring_t a = {0,0,0};
+			kputs("chr", &a); kputw(i & 0xffff, &a);
+			sum += a.l;
+			free(a.s);
+		}
+		fprintf(stderr, "short kstring_t: %lf (%ld)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+		t = clock();
+		for (i = 0; i < N; ++i) {
+			kstring_sso_t a;
+			ks_sso_init(&a, 0, 0);
+			kputs("chr", &a.str); kputw(i & 0xffff, &a.str);
+			sum += a.str.l;
+			ks_free(&a.str);
+		}
+		fprintf(stderr, "short kstring_sso_t: %lf (%ld)\n", (double)(clock() - t) / CLOCKS_PER_SEC, sum);
+	}
+
+	{ // search for 32 patterns
+		char *pat[32], *text;
+		int j, n_text = 10000000, *prep[32], max = 0, n_hits = 0;
+		ks_achit_t *hits = 0;
+		ks_ac_t *ac;
+		srand48(11);
+		text = (char*)malloc(n_text);
+		for (i = 0; i < n_text; ++i) text[i] = "ACGT"[lrand48() & 3];
+		for (i = 0; i < 32; ++i) {
+			int l = 8 + i % 8;
+			pat[i] = (char*)calloc(l + 1, 1);
+			for (j = 0; j < l; ++j) pat[i][j] = "ACGT"[lrand48() & 3];
+			prep[i] = 0;
+		}
+		t = clock();
+		for (i = 0; i < 32; ++i) {
+			const char *p = text, *q;
+			int l = strlen(pat[i]);
+			while ((q = (const char*)kmemmem(p, text + n_text - p, pat[i], l, &prep[i])) != 0)
+				++n_hits, p = q + 1;
+		}
+		fprintf(stderr, "kmemmem x32: %lf (%d)\n", (double)(clock() - t) / CLOCKS_PER_SEC, n_hits);
+		t = clock();
+		ac = ks_ac_init(32, (const char *const*)pat, 0);
+		n_hits = ks_ac_search(ac, text, n_text, &max, &hits);
+		fprintf(stderr, "ks_ac_search: %lf (%d)\n", (double)(clock() - t) / CLOCKS_PER_SEC, n_hits);
+		ks_ac_destroy(ac);
+		for (i = 0; i < 32; ++i) free(pat[i]), free(prep[i]);
+		free(hits); free(text);
+	}
+
+	free(s.s); free(s2.s);
 	return 0;
 }
@@ -1,4 +1,5 @@
 #include <limits.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -71,6 +72,119 @@ void test_kgetline(kstring_t *ks, const char *text, ...)
 	if (kgetline(ks, mem_gets, &text) == 0) check("kgetline()", ks, "EOF");
 }
 
+void test_kputd(kstring_t *ks, double x, const char *correct)
+{
+	ks->l = 0;
+	kputd(x, ks);
+	check("kputd()", ks, correct);
+}
+
+void test_kstrtod(const char *s, int l, double correct, int correct_l)
+{
+	const char *end;
+	double x = kstrtod(s, l, &end);
+	if (x != correct || end - s != correct_l) {
+		fprintf(stderr, "kstrtod(\"%.*s\") produced %g and %d (%g and %d are correct)\tFAIL\n", l, s, x, (int)(end - s), correct, correct_l);
+		nfail++;
+	}
+}
+
+void test_kstrtol(const char *s, int l, long correct, int correct_l)
+{
+	const char *end;
+	long x = kstrtol(s, l, &end);
+	if (x != correct || end - s != correct_l) {
+		fprintf(stderr, "kstrtol(\"%.*s\") produced %ld and %d (%ld and %d are correct)\tFAIL\n", l, s, x, (int)(end - s), correct, correct_l);
+		nfail++;
+	}
+}
+
+static int n_realloc = 0;
+
+static void *count_realloc(void *km, void *ptr, size_t size)
+{
+	(void)km;
+	++n_realloc;
+	if (size == 0) {
+		free(ptr);
+		return 0;
+	}
+	return realloc(ptr, size);
+}
+
+void test_sso(void)
+{
+	kstring_sso_t x;
+	int i;
+	ks_sso_init(&x, 0, count_realloc);
+	kputs("chr1", &x.str);
+	kputc('\t', &x.str);
+	kputw(12345, &x.str);
+	ksprintf(&x.str, ":%d", 6);
+	check("kstring_sso_t", &x.str, "chr1\t12345:6");
+	if (x.str.s != x.buf || n_realloc != 0) {
+		fprintf(stderr, "kstring_sso_t allocated a short string\tFAIL\n");
+		nfail++;
+	}
+	for (i = 0; i < 10; ++i) kputs("0123456789", &x.str);
+	if (x.str.l != 112 || x.str.s == x.buf || n_realloc == 0 || strncmp(x.str.s, "chr1\t12345:60123", 16) != 0) {
+		fprintf(stderr, "kstring_sso_t failed to grow\tFAIL\n");
+		nfail++;
+	}
+	ks_free(&x.str);
+	kputs("abc", &x.str);
+	check("kstring_sso_t after ks_free()", &x.str, "abc");
+	ks_free(&x.str);
+	if (n_realloc < 2) {
+		fprintf(stderr, "kstring_sso_t did not use the allocator to free\tFAIL\n");
+		nfail++;
+	}
+}
+
+void test_ks_ac(kstring_t *ks, const char *s, const char *correct)
+{
+	const char *pat[] = { "he", "she", "his", "hers", "he" };
+	ks_ac_t *ac;
+	ks_achit_t *hits = 0;
+	int i, n, max = 0;
+	ac = ks_ac_init(5, pat, 0);
+	n = ks_ac_search(ac, s, strlen(s), &max, &hits);
+	ks->l = 0;
+	kputsn("", 0, ks);
+	for (i = 0; i < n; ++i) ksprintf(ks, "%s%d:%d", i? " " : "", hits[i].pat, hits[i].pos);
+	check("ks_ac_search()", ks, correct);
+	free(hits);
+	ks_ac_destroy(ac);
+}
+
+void test_ksplit(kstring_t *ks, const char *s, int delimiter, const char *correct)
+{
+	kstring_t str = {0,0,0};
+	int i, n, *fields;
+	kputs(s, &str);
+	fields = ksplit(&str, delimiter, &n);
+	ks->l = 0;
+	kputsn("", 0, ks);
+	for (i = 0; i < n; ++i) {
+		if (i) kputc('|', ks);
+		kputs(str.s + fields[i], ks);
+	}
+	check("ksplit()", ks, correct);
+	free(fields); free(str.s);
+}
+
+void test_kstrtok(kstring_t *ks, const char *s, const char *sep, const char *correct)
+{
+	ks_tokaux_t aux;
+	const char *p;
+	ks->l = 0;
+	for (p = kstrtok(s, sep, &aux); p; p = kstrtok(0, 0, &aux)) {
+		if (p != s) kputc('|', ks);
+		kputsn(p, aux.p - p, ks);
+	}
+	check("kstrtok()", ks, correct);
+}
+
 int main(int argc, char **argv)
 {
 	kstring_t ks;
@@ -99,6 +213,52 @@ int main(int argc, char **argv)
 	test_kputl(&ks, -LONG_MAX);
 	test_kputl(&ks, LONG_MIN);
 
+	test_kputw(&ks, 9);
+	test_kputw(&ks, 10);
+	test_kputw(&ks, 100000);
+	test_kputw(&ks, 999999999);
+	test_kputl(&ks, 1000000000000000000L);
+
+	test_kputd(&ks, 0.0, "0");
+	test_kputd(&ks, -0.0, "-0");
+	test_kputd(&ks, 0.1, "0.1");
+	test_kputd(&ks, 0.3, "0.3");
+	test_kputd(&ks, 1 / 3.0, "0.3333333333333333");
+	test_kputd(&ks, 2.2250738585072014e-308, "2.2250738585072014e-308");
+	test_kputd(&ks, 1.5e-5, "1.5e-05");
+	test_kputd(&ks, 0.00015, "0.00015");
+	test_kputd(&ks, 100.0, "100");
+	test_kputd(&ks, -123.456, "-123.456");
+	test_kputd(&ks, 1e17, "1e+17");
+	test_kputd(&ks, 1e100, "1e+100");
+	test_kputd(&ks, 5e-324, "5e-324");
+	test_kputd(&ks, 1.7976931348623157e308, "1.7976931348623157e+308");
+	test_kputd(&ks, HUGE_VAL, "inf");
+
+	test_kstrtod("3.25\t", 5, 3.25, 4);
+	test_kstrtod("-1e3x", 5, -1e3, 4);
+	test_kstrtod("1e", 2, 1.0, 1);
+	test_kstrtod("12345", 3, 123.0, 3);
+	test_kstrtod("1.7976931348623157e308", 22, 1.7976931348623157e308, 22);
+	test_kstrtod("abc", 3, 0.0, 0);
+	test_kstrtol(" -42,", 5, -42, 4);
+	test_kstrtol("12345", 2, 12, 2);
+	test_kstrtol("+", 1, 0, 0);
+	test_kstrtol("99999999999999999999", 20, LONG_MAX, 20);
+
+	test_sso();
+
+	test_ks_ac(&ks, "", "");
+	test_ks_ac(&ks, "ushers", "1:1 4:2 0:2 3:2");
+	test_ks_ac(&ks, "hishe", "2:0 1:2 4:3 0:3");
+
+	test_ksplit(&ks, "", 0, "");
+	test_ksplit(&ks, " abc\tde  f ", 0, "abc|de|f");
+	test_ksplit(&ks, "\t\tchr1\t100\t\t.\tA", '\t', "chr1|100|.|A");
+	test_ksplit(&ks, "0123456789abcdefghij:0123456789abcdefghij::x:", ':', "0123456789abcdefghij|0123456789abcdefghij|x");
+	test_kstrtok(&ks, "ab:cde:fg/hij::k", ":/", "ab|cde|fg|hij||k");
+	test_kstrtok(&ks, "0123456789abcdefghij\t0123456789abcdefghijklmnopqrstuvwxyz\t", "\t", "0123456789abcdefghij|0123456789abcdefghijklmnopqrstuvwxyz|");
+
 	test_kgetline(&ks, "", NULL);
 	test_kgetline(&ks, "apple", "apple", NULL);
 	test_kgetline(&ks, "banana\n", "banana", NULL);
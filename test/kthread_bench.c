@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "kthread.h"
+
+static double realtime(void)
+{
+	struct timeval tp;
+	gettimeofday(&tp, 0);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+static void worker(void *data, long i, int tid) // a tiny amount of work per item
+{
+	long *a = (long*)data;
+	a[i] += i;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, j, n_threads = 4, n_rounds = 100000, n_items = 64;
+	int spin[] = { 0, 100, 1000, KT_SPIN_DEFAULT, 10000 };
+	long *a;
+	void *fp;
+	if (argc > 1) n_threads = atoi(argv[1]);
+	if (argc > 2) n_rounds = atoi(argv[2]);
+	if (argc > 3) n_items = atoi(argv[3]);
+	a = (long*)calloc(n_items, sizeof(long));
+	fp = kt_forpool_init(n_threads);
+	for (j = 0; j < (int)(sizeof(spin) / sizeof(int)); ++j) {
+		double t;
+		kt_forpool_set_spin(fp, spin[j]);
+		t = realtime();
+		for (i = 0; i < n_rounds; ++i)
+			kt_forpool(fp, worker, a, n_items);
+		t = realtime() - t;
+		printf("spin=%d\t%.3f usec/dispatch\n", spin[j], t * 1e6 / n_rounds);
+	}
+	{ // per-worker statistics of one more pass
+		kt_stats_t st = {0};
+		kt_forpool_set_stats(fp, &st);
+		for (i = 0; i < n_rounds; ++i)
+			kt_forpool(fp, worker, a, n_items);
+		kt_forpool_set_stats(fp, 0);
+		kt_stats_print(&st);
+		kt_stats_destroy(&st);
+	}
+	kt_forpool_destroy(fp);
+	for (i = 0; i < n_items; ++i) // sanity check
+		if (a[i] != (long)i * n_rounds * (sizeof(spin) / sizeof(int) + 1)) {
+			fprintf(stderr, "ERROR: wrong result at item %d\n", i);
+			return 1;
+		}
+	free(a);
+	return 0;
+}
@@ -2,9 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-
-void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
-void kt_pipeline(int n_threads, void *(*func)(void*, int, void*), void *shared_data, int n_steps);
+#include "kthread.h"
 
 typedef struct {
 	FILE *fp;
@@ -55,12 +53,21 @@ static void *worker_pipeline(void *shared, int step, void *in) // kt_pipeline()
 	return 0;
 }
 
+static void *worker_pipeline2(void *shared, int step, void *in, void *fp) // kt_pipeline2() callback
+{
+	if (step == 1) { // step 1: reverse lines with the inner thread pool
+		kt_forpool(fp, worker_for, in, ((step_t*)in)->n_lines);
+		return in;
+	}
+	return worker_pipeline(shared, step, in);
+}
+
 int main(int argc, char *argv[])
 {
 	pipeline_t pl;
 	int pl_threads;
 	if (argc == 1) {
-		fprintf(stderr, "Usage: reverse <in.txt> [pipeline_threads [for_threads]]\n");
+		fprintf(stderr, "Usage: reverse <in.txt> [pipeline_threads [for_threads [step1_batches [affinity]]]]\n");
 		return 1;
 	}
 	pl.fp = strcmp(argv[1], "-")? fopen(argv[1], "r") : stdin;
@@ -73,7 +80,16 @@ int main(int argc, char *argv[])
 	pl.buf_size = 0x10000;
 	pl.n_threads = argc > 3? atoi(argv[3]) : 1;
 	pl.buf = calloc(pl.buf_size, 1);
-	kt_pipeline(pl_threads, worker_pipeline, &pl, 3);
+	if (argc > 4) { // run step 1 on multiple batches, each with its own inner thread pool
+		ktp_step_t steps[3];
+		kt_stats_t st = {0};
+		memset(steps, 0, sizeof(steps));
+		steps[1].max_batches = atoi(argv[4]);
+		steps[1].n_threads = pl.n_threads;
+		kt_pipeline2(pl_threads, worker_pipeline2, &pl, 3, steps, argc > 5? atoi(argv[5]) : KT_AFF_NODE, &st); // affinity: KT_AFF_NONE=0, KT_AFF_CPU=1 or KT_AFF_NODE=2
+		kt_stats_print(&st);
+		kt_stats_destroy(&st);
+	} else kt_pipeline(pl_threads, worker_pipeline, &pl, 3);
 	free(pl.buf);
 	if (pl.fp != stdin) fclose(pl.fp);
 	return 0;
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "kthread.h"
+
+#define N_BINS 256
+
+typedef struct {
+	long n;
+	uint8_t *a;
+} data_t;
+
+static void hist_init(void *data, void *acc)
+{
+	memset(acc, 0, N_BINS * sizeof(int64_t));
+}
+
+static void hist_count(void *data, long st, long en, void *acc) // kt_reduce() callback
+{
+	data_t *d = (data_t*)data;
+	int64_t *h = (int64_t*)acc;
+	long i;
+	for (i = st; i < en; ++i) ++h[d->a[i]];
+}
+
+static void hist_merge(void *data, void *dst, const void *src)
+{
+	int64_t *h = (int64_t*)dst;
+	const int64_t *g = (const int64_t*)src;
+	int i;
+	for (i = 0; i < N_BINS; ++i) h[i] += g[i];
+}
+
+int main(int argc, char *argv[])
+{
+	int n_threads = argc > 1? atoi(argv[1]) : 4;
+	long i, n = argc > 2? atol(argv[2]) : 10000000;
+	int64_t hist[N_BINS], truth[N_BINS], *b, *c, sum;
+	data_t d;
+	void *fp;
+
+	d.n = n;
+	d.a = (uint8_t*)malloc(n);
+	srand(11);
+	for (i = 0; i < n; ++i) d.a[i] = rand() % 251;
+	fp = kt_forpool_init(n_threads);
+
+	// histogram with kt_reduce()
+	memset(truth, 0, sizeof(truth));
+	for (i = 0; i < n; ++i) ++truth[d.a[i]];
+	kt_reduce(fp, hist_count, hist_init, hist_merge, &d, n, 0, sizeof(hist), hist);
+	assert(memcmp(hist, truth, sizeof(hist)) == 0);
+	kt_reduce(fp, hist_count, hist_init, hist_merge, &d, n, 1000, sizeof(hist), hist);
+	assert(memcmp(hist, truth, sizeof(hist)) == 0);
+
+	// offsets with kt_scan()
+	b = (int64_t*)malloc(n * sizeof(int64_t));
+	c = (int64_t*)malloc(n * sizeof(int64_t));
+	for (i = 0; i < n; ++i) b[i] = d.a[i];
+	sum = kt_scan(fp, b, c, n, 0);
+	for (i = 0; i < n; ++i) assert(c[i] + b[i] == (i + 1 < n? c[i+1] : sum));
+	assert(c[0] == 0);
+	sum = kt_scan(fp, b, b, n, 1); // in place
+	for (i = 0; i < n; ++i) assert(b[i] == c[i] + d.a[i]);
+	assert(sum == b[n-1]);
+
+	kt_forpool_destroy(fp);
+
+	// every placement mode, with first-touch initialization of a buffer that is not a multiple of the block size
+	for (i = KT_AFF_NONE; i <= KT_AFF_NODE; ++i) {
+		long j, size = n + 123;
+		uint8_t *t = (uint8_t*)malloc(size);
+		memset(t, 0xff, size);
+		fp = kt_forpool_init2(n_threads, i);
+		kt_forpool_touch(fp, t, size, 4096);
+		for (j = 0; j < size; ++j) assert(t[j] == 0);
+		kt_reduce(fp, hist_count, hist_init, hist_merge, &d, n, 0, sizeof(hist), hist);
+		assert(memcmp(hist, truth, sizeof(hist)) == 0);
+		kt_forpool_destroy(fp);
+		free(t);
+	}
+	free(b); free(c); free(d.a);
+	printf("passed\n");
+	return 0;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "kwriter.h"
+
+static ssize_t mem_write(void *data, const void *buf, size_t len) // a kw_write_f appending to a kstring_t
+{
+	return kputsn_(buf, len, (kstring_t*)data);
+}
+
+static ssize_t fail_write(void *data, const void *buf, size_t len) // a kw_write_f that always fails
+{
+	return -1;
+}
+
+static void write_lines(kwriter_t *w, int n)
+{
+	char block[300];
+	int i;
+	memset(block, 'N', sizeof(block));
+	for (i = 0; i < n; ++i) {
+		kw_puts("chr1\t", w);
+		kw_putw(i, w);
+		kw_putc('\t', w);
+		kw_printf(w, "%.2f", i * 0.5);
+		if (i % 1000 == 0) kw_write(w, block, sizeof(block)); // larger than the high-water mark in check()
+		kw_putc('\n', w);
+	}
+}
+
+static void make_ref(kstring_t *s, int n) // the output of write_lines() without kwriter
+{
+	char block[300];
+	int i;
+	memset(block, 'N', sizeof(block));
+	s->l = 0;
+	for (i = 0; i < n; ++i) {
+		kputs("chr1\t", s);
+		kputw(i, s);
+		kputc('\t', s);
+		ksprintf(s, "%.2f", i * 0.5);
+		if (i % 1000 == 0) kputsn(block, sizeof(block), s);
+		kputc('\n', s);
+	}
+}
+
+static int check(const char *name, kwriter_t *w, int n, const kstring_t *out, const char *fn)
+{
+	kstring_t ref = {0,0,0};
+	int ret;
+	write_lines(w, n);
+	ret = kw_close(w);
+	make_ref(&ref, n);
+	if (fn) { // read back the file
+		kstring_t *o = (kstring_t*)out;
+		FILE *fp = fopen(fn, "rb");
+		char buf[4096];
+		size_t l;
+		o->l = 0;
+		while ((l = fread(buf, 1, sizeof(buf), fp)) > 0) kputsn_(buf, l, o);
+		fclose(fp);
+	}
+	if (ret != 0 || out->l != ref.l || memcmp(out->s, ref.s, ref.l) != 0) {
+		fprintf(stderr, "%s: FAIL\n", name);
+		free(ref.s);
+		return 1;
+	}
+	fprintf(stderr, "%s: %ld bytes OK\n", name, (long)ref.l);
+	free(ref.s);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *fn = "kwriter_test.tmp";
+	kstring_t out = {0,0,0};
+	kwriter_t *w;
+	FILE *fp;
+	int fd, n_fail = 0, n = 100000;
+
+	fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	n_fail += check("fd", kw_init_fd(fd, 256), n, &out, fn);
+	close(fd);
+
+	fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	w = kw_init_fd(fd, 256);
+	kw_start_flusher(w, 3);
+	n_fail += check("fd+flusher", w, n, &out, fn);
+	close(fd);
+
+	fp = fopen(fn, "wb");
+	w = kw_init_fp(fp, 1000);
+	kw_start_flusher(w, 2);
+	n_fail += check("FILE*+flusher", w, n, &out, fn);
+	fclose(fp);
+
+	fp = fopen(fn, "wb");
+	n_fail += check("FILE*", kw_init_fp(fp, 1000), n, &out, fn);
+	fclose(fp);
+
+	out.l = 0;
+	n_fail += check("func", kw_init_func(&out, mem_write, 100), n, &out, 0);
+
+	w = kw_init_func(0, fail_write, 100); // the error is set by the flusher thread and must reach kw_close()
+	kw_start_flusher(w, 2);
+	write_lines(w, 1000);
+	kw_flush(w), kw_flush(w); // the second call has an empty buffer
+	if (kw_close(w) == 0) fprintf(stderr, "func+flusher, failing: FAIL\n"), ++n_fail;
+	else fprintf(stderr, "func+flusher, failing: error reported OK\n");
+	unlink(fn);
+	free(out.s);
+
+	if (argc > 1) { // compare with a fputs() per line on /dev/null
+		clock_t t;
+		kstring_t s = {0,0,0};
+		int i;
+		n = atoi(argv[1]);
+		fp = fopen("/dev/null", "w");
+		t = clock();
+		for (i = 0; i < n; ++i) {
+			s.l = 0;
+			kputs("chr1\t", &s); kputw(i, &s); kputc('\n', &s);
+			fputs(s.s, fp);
+		}
+		fclose(fp);
+		fprintf(stderr, "kstring+fputs: %.3f\n", (double)(clock() - t) / CLOCKS_PER_SEC);
+		fd = open("/dev/null", O_WRONLY);
+		t = clock();
+		w = kw_init_fd(fd, 0);
+		for (i = 0; i < n; ++i) {
+			kw_puts("chr1\t", w); kw_putw(i, w); kw_putc('\n', w);
+		}
+		kw_close(w);
+		close(fd);
+		fprintf(stderr, "kwriter: %.3f\n", (double)(clock() - t) / CLOCKS_PER_SEC);
+	}
+	return n_fail? 1 : 0;
+}